@@ -0,0 +1,223 @@
+// Compares two result files written by `triangle --benchmark` and reports
+// which frame time changes are statistically significant, using Welch's
+// t-test on the per-frame samples. Exits with 1 when a metric regressed,
+// so it can gate CI.
+//
+//   bench_compare BASELINE.json CURRENT.json [--alpha A] [--threshold PCT]
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench_stats.h"
+
+namespace {
+
+// Differences with a larger p-value are treated as noise.
+constexpr double default_alpha = 0.01;
+// Significant differences smaller than this, in percent of the baseline
+// mean, are not reported as regressions.
+constexpr double default_threshold_pct = 1.0;
+
+struct BenchmarkRun {
+  std::string path;
+  std::string device;
+  std::string config;
+  double startup_ms = 0.0;
+  std::vector<double> cpu_frame_ms;
+  std::vector<double> gpu_frame_ms;
+};
+
+// Only reads the fields written by write_benchmark_results, not arbitrary
+// JSON.
+class ResultReader {
+public:
+  explicit ResultReader(std::string text) : text_(std::move(text)) {}
+
+  bool has(const std::string &key) const {
+    return text_.find(quoted(key)) != std::string::npos;
+  }
+
+  double number(const std::string &key) const {
+    size_t pos = value_start(key);
+    return std::strtod(text_.c_str() + pos, nullptr);
+  }
+
+  std::string string(const std::string &key) const {
+    size_t pos = value_start(key);
+    if (text_[pos] != '"') {
+      throw std::runtime_error{"\"" + key + "\" is not a string"};
+    }
+    std::string value;
+    for (++pos; pos < text_.size() && text_[pos] != '"'; ++pos) {
+      if (text_[pos] == '\\') {
+        ++pos;
+      }
+      value += text_[pos];
+    }
+    return value;
+  }
+
+  // The object's text, for comparing two of them literally.
+  std::string object(const std::string &key) const {
+    size_t pos = value_start(key);
+    size_t end = text_.find('}', pos);
+    if (text_[pos] != '{' || end == std::string::npos) {
+      throw std::runtime_error{"\"" + key + "\" is not an object"};
+    }
+    return text_.substr(pos, end - pos + 1);
+  }
+
+  // The "samples" array of the object under key.
+  std::vector<double> samples(const std::string &key) const {
+    size_t pos = text_.find(quoted("samples"), value_start(key));
+    pos = text_.find('[', pos);
+    size_t end = text_.find(']', pos);
+    if (pos == std::string::npos || end == std::string::npos) {
+      throw std::runtime_error{"\"" + key + "\" has no samples"};
+    }
+    std::vector<double> values;
+    const char *cursor = text_.c_str() + pos + 1;
+    const char *last = text_.c_str() + end;
+    while (cursor < last) {
+      char *next = nullptr;
+      double value = std::strtod(cursor, &next);
+      if (next == cursor) {
+        // Skip the separator.
+        ++cursor;
+        continue;
+      }
+      values.push_back(value);
+      cursor = next;
+    }
+    return values;
+  }
+
+private:
+  static std::string quoted(const std::string &key) {
+    return "\"" + key + "\":";
+  }
+
+  size_t value_start(const std::string &key) const {
+    size_t pos = text_.find(quoted(key));
+    if (pos == std::string::npos) {
+      throw std::runtime_error{"Missing \"" + key + "\""};
+    }
+    pos += quoted(key).size();
+    while (pos < text_.size() && std::isspace(static_cast<int>(text_[pos]))) {
+      ++pos;
+    }
+    return pos;
+  }
+
+  std::string text_;
+};
+
+BenchmarkRun load_run(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::runtime_error{"Failed to open " + path};
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  ResultReader reader{text.str()};
+
+  BenchmarkRun run;
+  run.path = path;
+  run.device = reader.string("device");
+  run.config = reader.object("config");
+  run.startup_ms = reader.number("startup_ms");
+  run.cpu_frame_ms = reader.samples("cpu_frame_ms");
+  if (reader.has("gpu_frame_ms")) {
+    run.gpu_frame_ms = reader.samples("gpu_frame_ms");
+  }
+  return run;
+}
+
+// Prints one row and returns whether the metric regressed.
+bool compare(const std::string &name, const std::vector<double> &baseline,
+             const std::vector<double> &current, double alpha,
+             double threshold_pct) {
+  Summary a = summarize(baseline);
+  Summary b = summarize(current);
+  double change_pct = a.mean > 0.0 ? (b.mean - a.mean) / a.mean * 100.0 : 0.0;
+  double p = welch_test(a, b).p;
+  bool significant = p < alpha && std::abs(change_pct) >= threshold_pct;
+  const char *verdict = !significant  ? "no change"
+                        : b.mean > a.mean ? "REGRESSION"
+                                          : "improvement";
+  std::cout << std::left << std::setw(14) << name << std::right << std::fixed
+            << std::setprecision(3) << " | " << std::setw(11) << a.mean
+            << " | " << std::setw(11) << b.mean << " | " << std::showpos
+            << std::setw(7) << std::setprecision(2) << change_pct
+            << std::noshowpos << "% | " << std::scientific
+            << std::setprecision(2) << std::setw(8) << p << " | " << verdict
+            << "\n";
+  return significant && b.mean > a.mean;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<std::string> paths;
+  double alpha = default_alpha;
+  double threshold_pct = default_threshold_pct;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      auto next_value = [&]() -> double {
+        if (i + 1 >= argc) {
+          throw std::runtime_error{"Missing value for " + arg};
+        }
+        return std::stod(argv[++i]);
+      };
+      if (arg == "--alpha") {
+        alpha = next_value();
+      } else if (arg == "--threshold") {
+        threshold_pct = next_value();
+      } else {
+        paths.push_back(arg);
+      }
+    }
+    if (paths.size() != 2) {
+      throw std::runtime_error{
+          "Usage: bench_compare BASELINE.json CURRENT.json [--alpha A] "
+          "[--threshold PCT]"};
+    }
+
+    BenchmarkRun baseline = load_run(paths[0]);
+    BenchmarkRun current = load_run(paths[1]);
+    if (baseline.device != current.device ||
+        baseline.config != current.config) {
+      std::cerr << "Warning: the runs used different devices or options\n"
+                << "  " << baseline.device << " " << baseline.config << "\n"
+                << "  " << current.device << " " << current.config
+                << std::endl;
+    }
+
+    std::cout << "metric         | baseline ms | current ms  | change   "
+                 "| p-value  | verdict\n";
+    bool regressed = compare("cpu frame time", baseline.cpu_frame_ms,
+                             current.cpu_frame_ms, alpha, threshold_pct);
+    if (!baseline.gpu_frame_ms.empty() && !current.gpu_frame_ms.empty()) {
+      regressed |= compare("gpu frame time", baseline.gpu_frame_ms,
+                           current.gpu_frame_ms, alpha, threshold_pct);
+    }
+    // One sample per run, so there is nothing to test.
+    std::cout << std::fixed << std::setprecision(3)
+              << "Startup: " << baseline.startup_ms << " ms -> "
+              << current.startup_ms << " ms" << std::endl;
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+}
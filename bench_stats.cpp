@@ -0,0 +1,91 @@
+#include "bench_stats.h"
+
+#include <cmath>
+
+namespace {
+
+// Continued fraction of the incomplete beta function, evaluated with the
+// modified Lentz method.
+double beta_continued_fraction(double a, double b, double x) {
+  constexpr double tiny = 1e-300;
+  constexpr double epsilon = 1e-14;
+  double c = 1.0;
+  double d = 1.0 - (a + b) * x / (a + 1.0);
+  d = 1.0 / (std::abs(d) < tiny ? tiny : d);
+  double result = d;
+  for (int m = 1; m <= 300; ++m) {
+    for (int step = 0; step < 2; ++step) {
+      double numerator =
+          step == 0
+              ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+              : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+      d = 1.0 + numerator * d;
+      d = 1.0 / (std::abs(d) < tiny ? tiny : d);
+      c = 1.0 + numerator / c;
+      c = std::abs(c) < tiny ? tiny : c;
+      result *= d * c;
+      if (step == 1 && std::abs(d * c - 1.0) < epsilon) {
+        return result;
+      }
+    }
+  }
+  return result;
+}
+
+// Regularized incomplete beta function I_x(a, b).
+double incomplete_beta(double a, double b, double x) {
+  if (x <= 0.0) {
+    return 0.0;
+  }
+  if (x >= 1.0) {
+    return 1.0;
+  }
+  double front = std::exp(std::lgamma(a + b) - std::lgamma(a) -
+                          std::lgamma(b) + a * std::log(x) +
+                          b * std::log(1.0 - x));
+  // The continued fraction converges quickly only below this point.
+  if (x < (a + 1.0) / (a + b + 2.0)) {
+    return front * beta_continued_fraction(a, b, x) / a;
+  }
+  return 1.0 - front * beta_continued_fraction(b, a, 1.0 - x) / b;
+}
+
+} // namespace
+
+Summary summarize(const std::vector<double> &samples) {
+  Summary summary;
+  summary.count = samples.size();
+  if (samples.empty()) {
+    return summary;
+  }
+  for (double value : samples) {
+    summary.mean += value;
+  }
+  summary.mean /= samples.size();
+  if (samples.size() > 1) {
+    for (double value : samples) {
+      summary.variance += (value - summary.mean) * (value - summary.mean);
+    }
+    summary.variance /= samples.size() - 1;
+  }
+  return summary;
+}
+
+WelchResult welch_test(const Summary &a, const Summary &b) {
+  WelchResult result;
+  if (a.count < 2 || b.count < 2) {
+    return result;
+  }
+  double va = a.variance / a.count;
+  double vb = b.variance / b.count;
+  if (va + vb == 0.0) {
+    result.p = a.mean == b.mean ? 1.0 : 0.0;
+    return result;
+  }
+  result.t = (b.mean - a.mean) / std::sqrt(va + vb);
+  result.df = (va + vb) * (va + vb) /
+              (va * va / (a.count - 1) + vb * vb / (b.count - 1));
+  result.p = incomplete_beta(result.df / 2.0, 0.5,
+                             result.df / (result.df + result.t * result.t));
+  return result;
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <cstddef>
+#include <vector>
+
+// Mean and unbiased sample variance of a set of frame times.
+struct Summary {
+  double mean = 0.0;
+  double variance = 0.0;
+  size_t count = 0;
+};
+
+Summary summarize(const std::vector<double> &samples);
+
+struct WelchResult {
+  // Positive when b has the larger mean.
+  double t = 0.0;
+  // Welch-Satterthwaite degrees of freedom.
+  double df = 0.0;
+  // Two-sided p-value.
+  double p = 1.0;
+};
+
+// Welch's t-test for a difference in the means of a and b, which may have
+// different variances. With fewer than two samples on either side p is 1;
+// with no variance at all p is 1 for equal means and 0 otherwise, and t and
+// df are left at 0.
+WelchResult welch_test(const Summary &a, const Summary &b);
+
+#endif // BENCH_STATS_H
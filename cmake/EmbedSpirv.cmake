@@ -0,0 +1,41 @@
+# Converts a SPIR-V binary into a C++ header holding it as a constexpr
+# uint32_t array, so shaders are compiled into the executable.
+#
+# Usage: cmake -DINPUT=<file.spv> -DOUTPUT=<header.h> -DSYMBOL=<name>
+#              -P EmbedSpirv.cmake
+
+file(READ ${INPUT} SPIRV_HEX HEX)
+string(LENGTH "${SPIRV_HEX}" SPIRV_HEX_LENGTH)
+math(EXPR SPIRV_REMAINDER "${SPIRV_HEX_LENGTH} % 8")
+if(SPIRV_HEX_LENGTH EQUAL 0 OR NOT SPIRV_REMAINDER EQUAL 0)
+  message(FATAL_ERROR "${INPUT} is not a SPIR-V binary")
+endif()
+
+# SPIR-V words are stored little-endian; emit them as numbers, eight per
+# line.
+string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1, " SPIRV_WORDS
+                     "${SPIRV_HEX}")
+string(REPEAT "0x[0-9a-f]+, " 8 SPIRV_LINE)
+string(REGEX REPLACE "(${SPIRV_LINE})" "\\1\n    " SPIRV_WORDS
+                     "${SPIRV_WORDS}")
+string(REPLACE ", \n" ",\n" SPIRV_WORDS "${SPIRV_WORDS}")
+string(REGEX REPLACE "[ ,\n]+$" "" SPIRV_WORDS "${SPIRV_WORDS}")
+string(TOUPPER ${SYMBOL}_H GUARD)
+get_filename_component(SOURCE_NAME ${INPUT} NAME)
+
+file(WRITE ${OUTPUT}
+"// Generated from ${SOURCE_NAME} by EmbedSpirv.cmake, do not edit.
+#ifndef ${GUARD}
+#define ${GUARD}
+
+#include <cstdint>
+
+namespace shaders {
+
+inline constexpr uint32_t ${SYMBOL}[] = {
+    ${SPIRV_WORDS}};
+
+} // namespace shaders
+
+#endif // ${GUARD}
+")
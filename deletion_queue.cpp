@@ -0,0 +1,29 @@
+#include "deletion_queue.h"
+
+#include <algorithm>
+
+void DeletionQueue::push(uint64_t value, std::function<void()> destroy) {
+  // Holding an entry longer than needed is always safe; keeping the queue
+  // sorted that way makes collect() a scan from the front.
+  if (!entries_.empty()) {
+    value = std::max(value, entries_.back().value);
+  }
+  entries_.push_back({value, std::move(destroy)});
+}
+
+void DeletionQueue::collect(QueueTimeline &timeline) {
+  while (!entries_.empty() && timeline.is_complete(entries_.front().value)) {
+    // Popped first, so a destructor may push new entries.
+    std::function<void()> destroy = std::move(entries_.front().destroy);
+    entries_.pop_front();
+    destroy();
+  }
+}
+
+void DeletionQueue::flush() {
+  while (!entries_.empty()) {
+    std::function<void()> destroy = std::move(entries_.front().destroy);
+    entries_.pop_front();
+    destroy();
+  }
+}
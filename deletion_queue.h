@@ -0,0 +1,40 @@
+#ifndef DELETION_QUEUE_H
+#define DELETION_QUEUE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+#include "queue_timeline.h"
+
+// Destroys objects once the GPU work that may still use them has finished,
+// so nothing has to wait for the device to go idle before it is replaced.
+// Every entry is tagged with the value of the last submission on a
+// timeline that could use it; collect() runs the destructors of entries
+// the timeline has passed.
+class DeletionQueue {
+public:
+  DeletionQueue() = default;
+  DeletionQueue(const DeletionQueue &) = delete;
+  DeletionQueue &operator=(const DeletionQueue &) = delete;
+
+  // destroy runs once value has been reached.
+  void push(uint64_t value, std::function<void()> destroy);
+  // Runs every entry whose value timeline has reached. Cheap when there is
+  // nothing to do, meant to be called once per frame.
+  void collect(QueueTimeline &timeline);
+  // Runs every entry. Only valid once the device is idle.
+  void flush();
+
+  size_t size() const { return entries_.size(); }
+
+private:
+  struct Entry {
+    uint64_t value;
+    std::function<void()> destroy;
+  };
+  // Non-decreasing values, so collect() stops at the first pending entry.
+  std::deque<Entry> entries_;
+};
+
+#endif // DELETION_QUEUE_H
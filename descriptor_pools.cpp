@@ -0,0 +1,81 @@
+#include "descriptor_pools.h"
+
+#include <stdexcept>
+#include <utility>
+
+void DescriptorPools::init(VkDevice device, uint32_t frames_in_flight,
+                           uint32_t max_sets,
+                           std::vector<VkDescriptorPoolSize> sizes) {
+  device_ = device;
+  max_sets_ = max_sets;
+  sizes_ = std::move(sizes);
+  frames_.assign(frames_in_flight, FramePools{});
+}
+
+void DescriptorPools::destroy() {
+  for (auto &frame : frames_) {
+    for (VkDescriptorPool pool : frame.used) {
+      vkDestroyDescriptorPool(device_, pool, nullptr);
+    }
+    for (VkDescriptorPool pool : frame.free) {
+      vkDestroyDescriptorPool(device_, pool, nullptr);
+    }
+  }
+  frames_.clear();
+}
+
+void DescriptorPools::reset(uint32_t frame) {
+  FramePools &pools = frames_[frame];
+  for (VkDescriptorPool pool : pools.used) {
+    vkResetDescriptorPool(device_, pool, 0);
+    pools.free.push_back(pool);
+  }
+  pools.used.clear();
+}
+
+VkDescriptorSet DescriptorPools::allocate(uint32_t frame,
+                                          VkDescriptorSetLayout layout) {
+  FramePools &pools = frames_[frame];
+  VkDescriptorSetAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &layout;
+
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  if (!pools.used.empty()) {
+    allocInfo.descriptorPool = pools.used.back();
+    VkResult result = vkAllocateDescriptorSets(device_, &allocInfo, &set);
+    if (result == VK_SUCCESS) {
+      return set;
+    }
+    if (result != VK_ERROR_OUT_OF_POOL_MEMORY &&
+        result != VK_ERROR_FRAGMENTED_POOL) {
+      throw std::runtime_error{"Failed to allocate descriptor set!"};
+    }
+  }
+  allocInfo.descriptorPool = take_pool(pools);
+  if (vkAllocateDescriptorSets(device_, &allocInfo, &set) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to allocate descriptor set!"};
+  }
+  return set;
+}
+
+VkDescriptorPool DescriptorPools::take_pool(FramePools &frame) {
+  VkDescriptorPool pool = VK_NULL_HANDLE;
+  if (!frame.free.empty()) {
+    pool = frame.free.back();
+    frame.free.pop_back();
+  } else {
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = max_sets_;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(sizes_.size());
+    poolInfo.pPoolSizes = sizes_.data();
+    if (vkCreateDescriptorPool(device_, &poolInfo, nullptr, &pool) !=
+        VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor pool!"};
+    }
+  }
+  frame.used.push_back(pool);
+  return pool;
+}
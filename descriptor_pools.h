@@ -0,0 +1,45 @@
+#ifndef DESCRIPTOR_POOLS_H
+#define DESCRIPTOR_POOLS_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+// Descriptor sets that live for one frame. Every frame in flight owns its
+// own pools; reset() recycles all sets of a frame at once when the frame
+// comes around again, so sets are never freed one by one and a pool is
+// never touched while the GPU may still read from it. A frame takes
+// another pool when its current one runs out.
+class DescriptorPools {
+public:
+  DescriptorPools() = default;
+  DescriptorPools(const DescriptorPools &) = delete;
+  DescriptorPools &operator=(const DescriptorPools &) = delete;
+
+  // Every pool holds max_sets sets and the descriptors in sizes.
+  void init(VkDevice device, uint32_t frames_in_flight, uint32_t max_sets,
+            std::vector<VkDescriptorPoolSize> sizes);
+  void destroy();
+
+  // Only valid once the frame's previous submission has finished.
+  void reset(uint32_t frame);
+  VkDescriptorSet allocate(uint32_t frame, VkDescriptorSetLayout layout);
+
+private:
+  struct FramePools {
+    // Pools handed out since the last reset, the last one being current.
+    std::vector<VkDescriptorPool> used;
+    // Reset pools kept for reuse.
+    std::vector<VkDescriptorPool> free;
+  };
+
+  VkDescriptorPool take_pool(FramePools &frame);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  uint32_t max_sets_ = 0;
+  std::vector<VkDescriptorPoolSize> sizes_;
+  std::vector<FramePools> frames_;
+};
+
+#endif // DESCRIPTOR_POOLS_H
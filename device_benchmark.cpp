@@ -0,0 +1,508 @@
+#include "device_benchmark.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <shader_bundle.h>
+
+#include "gpu_allocator.h"
+
+namespace {
+
+// First line of the cache file; files with any other first line are
+// ignored and rewritten.
+constexpr const char *cache_header = "device-benchmark 1";
+
+// Square render target, in pixels.
+constexpr uint32_t target_size = 1024;
+// Full-target triangles drawn for the fill rate.
+constexpr uint32_t fill_layers = 64;
+// Half-pixel triangles drawn for the triangle throughput.
+constexpr uint32_t triangle_count = 1u << 20;
+
+// Push constants of bench.vert.
+struct BenchParams {
+  uint32_t mode;
+  uint32_t size;
+};
+constexpr uint32_t mode_fill = 0;
+constexpr uint32_t mode_triangles = 1;
+
+// Everything the benchmark creates, released on every path out of run().
+struct BenchContext {
+  VkDevice device = VK_NULL_HANDLE;
+  GpuAllocator allocator;
+  bool allocator_ready = false;
+  VkImage image = VK_NULL_HANDLE;
+  GpuAllocation memory;
+  VkImageView view = VK_NULL_HANDLE;
+  VkRenderPass render_pass = VK_NULL_HANDLE;
+  VkFramebuffer framebuffer = VK_NULL_HANDLE;
+  VkShaderModule vertex_shader = VK_NULL_HANDLE;
+  VkShaderModule fragment_shader = VK_NULL_HANDLE;
+  VkPipelineLayout layout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  VkCommandPool command_pool = VK_NULL_HANDLE;
+  VkQueryPool queries = VK_NULL_HANDLE;
+  VkFence fence = VK_NULL_HANDLE;
+
+  BenchContext() = default;
+  BenchContext(const BenchContext &) = delete;
+  BenchContext &operator=(const BenchContext &) = delete;
+  ~BenchContext() {
+    if (device == VK_NULL_HANDLE) {
+      return;
+    }
+    vkDeviceWaitIdle(device);
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyQueryPool(device, queries, nullptr);
+    vkDestroyCommandPool(device, command_pool, nullptr);
+    vkDestroyPipeline(device, pipeline, nullptr);
+    vkDestroyPipelineLayout(device, layout, nullptr);
+    vkDestroyShaderModule(device, fragment_shader, nullptr);
+    vkDestroyShaderModule(device, vertex_shader, nullptr);
+    vkDestroyFramebuffer(device, framebuffer, nullptr);
+    vkDestroyRenderPass(device, render_pass, nullptr);
+    vkDestroyImageView(device, view, nullptr);
+    if (image != VK_NULL_HANDLE) {
+      allocator.destroy_image(image, memory);
+    }
+    if (allocator_ready) {
+      allocator.destroy();
+    }
+    vkDestroyDevice(device, nullptr);
+  }
+};
+
+VkShaderModule create_shader_module(VkDevice device, const uint32_t *code,
+                                    size_t size) {
+  VkShaderModuleCreateInfo createInfo{};
+  createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  createInfo.codeSize = size;
+  createInfo.pCode = code;
+  VkShaderModule module;
+  if (vkCreateShaderModule(device, &createInfo, nullptr, &module) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark shader module!"};
+  }
+  return module;
+}
+
+void create_target(BenchContext &ctx) {
+  VkImageCreateInfo imageInfo{};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  imageInfo.extent = {target_size, target_size, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  ctx.memory = ctx.allocator.create_image(
+      imageInfo, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, ctx.image);
+
+  VkImageViewCreateInfo viewInfo{};
+  viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  viewInfo.image = ctx.image;
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.format = imageInfo.format;
+  viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  viewInfo.subresourceRange.levelCount = 1;
+  viewInfo.subresourceRange.layerCount = 1;
+  if (vkCreateImageView(ctx.device, &viewInfo, nullptr, &ctx.view) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark image view!"};
+  }
+
+  VkAttachmentDescription attachment{};
+  attachment.format = imageInfo.format;
+  attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference colorRef{};
+  colorRef.attachment = 0;
+  colorRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass{};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &colorRef;
+
+  // The timed run clears the image the warm-up run wrote.
+  VkSubpassDependency dependency{};
+  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependency.dstSubpass = 0;
+  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+  VkRenderPassCreateInfo renderPassInfo{};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassInfo.attachmentCount = 1;
+  renderPassInfo.pAttachments = &attachment;
+  renderPassInfo.subpassCount = 1;
+  renderPassInfo.pSubpasses = &subpass;
+  renderPassInfo.dependencyCount = 1;
+  renderPassInfo.pDependencies = &dependency;
+  if (vkCreateRenderPass(ctx.device, &renderPassInfo, nullptr,
+                         &ctx.render_pass) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark render pass!"};
+  }
+
+  VkFramebufferCreateInfo framebufferInfo{};
+  framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebufferInfo.renderPass = ctx.render_pass;
+  framebufferInfo.attachmentCount = 1;
+  framebufferInfo.pAttachments = &ctx.view;
+  framebufferInfo.width = target_size;
+  framebufferInfo.height = target_size;
+  framebufferInfo.layers = 1;
+  if (vkCreateFramebuffer(ctx.device, &framebufferInfo, nullptr,
+                          &ctx.framebuffer) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark framebuffer!"};
+  }
+}
+
+void create_pipeline(BenchContext &ctx) {
+  ctx.vertex_shader = create_shader_module(
+      ctx.device, shaders::bench_vert_spv, sizeof(shaders::bench_vert_spv));
+  ctx.fragment_shader = create_shader_module(
+      ctx.device, shaders::bench_frag_spv, sizeof(shaders::bench_frag_spv));
+
+  VkPushConstantRange pushRange{};
+  pushRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  pushRange.offset = 0;
+  pushRange.size = sizeof(BenchParams);
+
+  VkPipelineLayoutCreateInfo layoutInfo{};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layoutInfo.pushConstantRangeCount = 1;
+  layoutInfo.pPushConstantRanges = &pushRange;
+  if (vkCreatePipelineLayout(ctx.device, &layoutInfo, nullptr, &ctx.layout) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark pipeline layout!"};
+  }
+
+  VkPipelineShaderStageCreateInfo stages[2]{};
+  stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  stages[0].module = ctx.vertex_shader;
+  stages[0].pName = "main";
+  stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  stages[1].module = ctx.fragment_shader;
+  stages[1].pName = "main";
+
+  VkPipelineVertexInputStateCreateInfo vertexInput{};
+  vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+  VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+  inputAssembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkViewport viewport{};
+  viewport.width = static_cast<float>(target_size);
+  viewport.height = static_cast<float>(target_size);
+  viewport.maxDepth = 1.0f;
+  VkRect2D scissor{};
+  scissor.extent = {target_size, target_size};
+
+  VkPipelineViewportStateCreateInfo viewportState{};
+  viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportState.viewportCount = 1;
+  viewportState.pViewports = &viewport;
+  viewportState.scissorCount = 1;
+  viewportState.pScissors = &scissor;
+
+  VkPipelineRasterizationStateCreateInfo rasterizer{};
+  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizer.cullMode = VK_CULL_MODE_NONE;
+  rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  rasterizer.lineWidth = 1.0f;
+
+  VkPipelineMultisampleStateCreateInfo multisampling{};
+  multisampling.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkPipelineColorBlendAttachmentState blendAttachment{};
+  blendAttachment.colorWriteMask =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+
+  VkPipelineColorBlendStateCreateInfo colorBlending{};
+  colorBlending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  colorBlending.attachmentCount = 1;
+  colorBlending.pAttachments = &blendAttachment;
+
+  VkGraphicsPipelineCreateInfo pipelineInfo{};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.stageCount = 2;
+  pipelineInfo.pStages = stages;
+  pipelineInfo.pVertexInputState = &vertexInput;
+  pipelineInfo.pInputAssemblyState = &inputAssembly;
+  pipelineInfo.pViewportState = &viewportState;
+  pipelineInfo.pRasterizationState = &rasterizer;
+  pipelineInfo.pMultisampleState = &multisampling;
+  pipelineInfo.pColorBlendState = &colorBlending;
+  pipelineInfo.layout = ctx.layout;
+  pipelineInfo.renderPass = ctx.render_pass;
+  pipelineInfo.subpass = 0;
+  if (vkCreateGraphicsPipelines(ctx.device, VK_NULL_HANDLE, 1, &pipelineInfo,
+                                nullptr, &ctx.pipeline) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark pipeline!"};
+  }
+}
+
+// Query 0 starts the fill draws, query 1 ends them and starts the triangle
+// draws, query 2 ends those.
+void record(BenchContext &ctx, VkCommandBuffer command_buffer) {
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  if (vkBeginCommandBuffer(command_buffer, &beginInfo) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to begin benchmark command buffer!"};
+  }
+  vkCmdResetQueryPool(command_buffer, ctx.queries, 0, 3);
+
+  VkClearValue clear{};
+  VkRenderPassBeginInfo renderPassInfo{};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = ctx.render_pass;
+  renderPassInfo.framebuffer = ctx.framebuffer;
+  renderPassInfo.renderArea.extent = {target_size, target_size};
+  renderPassInfo.clearValueCount = 1;
+  renderPassInfo.pClearValues = &clear;
+  vkCmdBeginRenderPass(command_buffer, &renderPassInfo,
+                       VK_SUBPASS_CONTENTS_INLINE);
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    ctx.pipeline);
+
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                      ctx.queries, 0);
+  BenchParams params{mode_fill, target_size};
+  vkCmdPushConstants(command_buffer, ctx.layout, VK_SHADER_STAGE_VERTEX_BIT,
+                     0, sizeof(params), &params);
+  vkCmdDraw(command_buffer, 3, fill_layers, 0, 0);
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      ctx.queries, 1);
+
+  params.mode = mode_triangles;
+  vkCmdPushConstants(command_buffer, ctx.layout, VK_SHADER_STAGE_VERTEX_BIT,
+                     0, sizeof(params), &params);
+  vkCmdDraw(command_buffer, 3 * triangle_count, 1, 0, 0);
+  vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      ctx.queries, 2);
+
+  vkCmdEndRenderPass(command_buffer);
+  if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to record benchmark command buffer!"};
+  }
+}
+
+} // namespace
+
+DeviceBenchmark::DeviceBenchmark(std::string cache_file)
+    : cache_file_(std::move(cache_file)) {
+  load();
+}
+
+DeviceBenchmarkResult DeviceBenchmark::measure(VkPhysicalDevice physical_device,
+                                               uint32_t graphics_family) {
+  std::string key = key_for(physical_device);
+  auto it = results_.find(key);
+  if (it != results_.end()) {
+    DeviceBenchmarkResult result = it->second;
+    result.cached = true;
+    return result;
+  }
+  DeviceBenchmarkResult result = run(physical_device, graphics_family);
+  results_[key] = result;
+  dirty_ = true;
+  return result;
+}
+
+void DeviceBenchmark::save() const {
+  if (cache_file_.empty() || !dirty_) {
+    return;
+  }
+  // Write next to the target and rename, like the pipeline cache.
+  std::string tmp_path = cache_file_ + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    if (!file.is_open()) {
+      std::cerr << "Failed to write device benchmark cache " << tmp_path
+                << std::endl;
+      return;
+    }
+    file << cache_header << "\n" << std::setprecision(17);
+    for (const auto &[key, result] : results_) {
+      file << key << " " << result.fill_gpixels << " " << result.mtriangles
+           << "\n";
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, cache_file_, ec);
+  if (ec) {
+    std::cerr << "Failed to save device benchmark cache: " << ec.message()
+              << std::endl;
+  }
+}
+
+std::string DeviceBenchmark::key_for(VkPhysicalDevice physical_device) {
+  VkPhysicalDeviceIDProperties idProperties{};
+  idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+  VkPhysicalDeviceProperties2 properties{};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties.pNext = &idProperties;
+  vkGetPhysicalDeviceProperties2(physical_device, &properties);
+
+  std::ostringstream key;
+  key << std::hex << std::setfill('0');
+  for (uint8_t byte : idProperties.deviceUUID) {
+    key << std::setw(2) << static_cast<uint32_t>(byte);
+  }
+  key << "-" << properties.properties.driverVersion;
+  return key.str();
+}
+
+DeviceBenchmarkResult DeviceBenchmark::run(VkPhysicalDevice physical_device,
+                                           uint32_t graphics_family) {
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &familyCount,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(familyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &familyCount,
+                                           families.data());
+  uint32_t validBits = families[graphics_family].timestampValidBits;
+  if (validBits == 0) {
+    throw std::runtime_error{"The graphics queue has no timestamps!"};
+  }
+  uint64_t timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  BenchContext ctx;
+  float priority = 1.0f;
+  VkDeviceQueueCreateInfo queueInfo{};
+  queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queueInfo.queueFamilyIndex = graphics_family;
+  queueInfo.queueCount = 1;
+  queueInfo.pQueuePriorities = &priority;
+  VkDeviceCreateInfo deviceInfo{};
+  deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  deviceInfo.queueCreateInfoCount = 1;
+  deviceInfo.pQueueCreateInfos = &queueInfo;
+  if (vkCreateDevice(physical_device, &deviceInfo, nullptr, &ctx.device) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark device!"};
+  }
+  VkQueue queue;
+  vkGetDeviceQueue(ctx.device, graphics_family, 0, &queue);
+  ctx.allocator.init(physical_device, ctx.device);
+  ctx.allocator_ready = true;
+
+  create_target(ctx);
+  create_pipeline(ctx);
+
+  VkCommandPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = graphics_family;
+  if (vkCreateCommandPool(ctx.device, &poolInfo, nullptr,
+                          &ctx.command_pool) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark command pool!"};
+  }
+  VkCommandBufferAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = ctx.command_pool;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+  VkCommandBuffer commandBuffer;
+  if (vkAllocateCommandBuffers(ctx.device, &allocInfo, &commandBuffer) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to allocate benchmark command buffer!"};
+  }
+
+  VkQueryPoolCreateInfo queryInfo{};
+  queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryInfo.queryCount = 3;
+  if (vkCreateQueryPool(ctx.device, &queryInfo, nullptr, &ctx.queries) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark query pool!"};
+  }
+  VkFenceCreateInfo fenceInfo{};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  if (vkCreateFence(ctx.device, &fenceInfo, nullptr, &ctx.fence) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create benchmark fence!"};
+  }
+
+  record(ctx, commandBuffer);
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &commandBuffer;
+  // The first run pays for lazy driver setup and is not timed.
+  for (int pass = 0; pass < 2; ++pass) {
+    vkResetFences(ctx.device, 1, &ctx.fence);
+    if (vkQueueSubmit(queue, 1, &submitInfo, ctx.fence) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to submit benchmark!"};
+    }
+    vkWaitForFences(ctx.device, 1, &ctx.fence, VK_TRUE, UINT64_MAX);
+  }
+
+  uint64_t timestamps[3];
+  if (vkGetQueryPoolResults(ctx.device, ctx.queries, 0, 3, sizeof(timestamps),
+                            timestamps, sizeof(uint64_t),
+                            VK_QUERY_RESULT_64_BIT |
+                                VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to read benchmark timestamps!"};
+  }
+  double period = properties.limits.timestampPeriod;
+  // Clamped so a coarse timer cannot divide by zero.
+  double fill_ns = std::max(
+      1.0, ((timestamps[1] - timestamps[0]) & timestampMask) * period);
+  double triangle_ns = std::max(
+      1.0, ((timestamps[2] - timestamps[1]) & timestampMask) * period);
+
+  DeviceBenchmarkResult result;
+  result.fill_gpixels =
+      static_cast<double>(target_size) * target_size * fill_layers / fill_ns;
+  result.mtriangles = triangle_count / triangle_ns * 1e3;
+  return result;
+}
+
+void DeviceBenchmark::load() {
+  if (cache_file_.empty()) {
+    return;
+  }
+  std::ifstream file(cache_file_);
+  std::string header;
+  if (!std::getline(file, header) || header != cache_header) {
+    return;
+  }
+  std::string key;
+  DeviceBenchmarkResult result;
+  while (file >> key >> result.fill_gpixels >> result.mtriangles) {
+    results_[key] = result;
+  }
+}
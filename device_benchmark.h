@@ -0,0 +1,53 @@
+#ifndef DEVICE_BENCHMARK_H
+#define DEVICE_BENCHMARK_H
+
+#include <vulkan/vulkan.h>
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Throughput of one physical device, as measured by DeviceBenchmark.
+struct DeviceBenchmarkResult {
+  // Billions of pixels written per second by full-target triangles.
+  double fill_gpixels = 0.0;
+  // Millions of half-pixel triangles drawn per second.
+  double mtriangles = 0.0;
+  // Set when the result came from the cache file.
+  bool cached = false;
+
+  // Geometric mean, so neither figure dominates the ranking.
+  double score() const { return std::sqrt(fill_gpixels * mtriangles); }
+};
+
+// Measures fill rate and triangle throughput of physical devices with a
+// short offscreen render on a temporary logical device. Results are kept
+// in a text file keyed by device UUID and driver version, so a device is
+// only benchmarked again after a driver update.
+class DeviceBenchmark {
+public:
+  // An empty cache_file disables the cache.
+  explicit DeviceBenchmark(std::string cache_file);
+  DeviceBenchmark(const DeviceBenchmark &) = delete;
+  DeviceBenchmark &operator=(const DeviceBenchmark &) = delete;
+
+  // Returns the cached result for the device, or benchmarks it on a queue
+  // of graphics_family. Throws when the device cannot run the benchmark.
+  DeviceBenchmarkResult measure(VkPhysicalDevice physical_device,
+                                uint32_t graphics_family);
+  // Writes the cache file if anything was benchmarked since it was read.
+  void save() const;
+
+private:
+  static std::string key_for(VkPhysicalDevice physical_device);
+  static DeviceBenchmarkResult run(VkPhysicalDevice physical_device,
+                                   uint32_t graphics_family);
+  void load();
+
+  std::string cache_file_;
+  std::map<std::string, DeviceBenchmarkResult> results_;
+  bool dirty_ = false;
+};
+
+#endif // DEVICE_BENCHMARK_H
@@ -0,0 +1,457 @@
+#include "gpu_allocator.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+// Blocks are 64 MiB, shrunk on small heaps so one block never takes more
+// than an eighth of the heap.
+constexpr VkDeviceSize default_block_size = 64ull << 20;
+constexpr VkDeviceSize min_block_size = 1ull << 20;
+constexpr VkDeviceSize min_node_size = 256;
+
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+  return alignment == 0 ? value
+                        : (value + alignment - 1) / alignment * alignment;
+}
+
+double to_mib(VkDeviceSize bytes) {
+  return static_cast<double>(bytes) / (1024.0 * 1024.0);
+}
+
+} // namespace
+
+BuddyBlock::BuddyBlock(VkDeviceSize size, VkDeviceSize min_node_size)
+    : size_{size}, min_node_size_{min_node_size}, max_order_{0} {
+  while (node_size(max_order_) < size_) {
+    ++max_order_;
+  }
+  free_lists_.resize(max_order_ + 1);
+  free_lists_[max_order_].insert(0);
+}
+
+uint32_t BuddyBlock::order_for(VkDeviceSize size) const {
+  uint32_t order = 0;
+  while (node_size(order) < size) {
+    ++order;
+  }
+  return order;
+}
+
+std::optional<VkDeviceSize> BuddyBlock::allocate(VkDeviceSize size) {
+  if (size > size_) {
+    return std::nullopt;
+  }
+  uint32_t order = order_for(size);
+  uint32_t found = order;
+  while (found <= max_order_ && free_lists_[found].empty()) {
+    ++found;
+  }
+  if (found > max_order_) {
+    return std::nullopt;
+  }
+
+  VkDeviceSize offset = *free_lists_[found].begin();
+  free_lists_[found].erase(free_lists_[found].begin());
+  // Split down to the requested order, keeping the lower halves.
+  while (found > order) {
+    --found;
+    free_lists_[found].insert(offset + node_size(found));
+  }
+  allocated_[offset] = order;
+  used_ += node_size(order);
+  return offset;
+}
+
+VkDeviceSize BuddyBlock::free(VkDeviceSize offset) {
+  auto it = allocated_.find(offset);
+  if (it == allocated_.end()) {
+    throw std::logic_error{"Freeing memory that was not allocated!"};
+  }
+  uint32_t order = it->second;
+  allocated_.erase(it);
+  VkDeviceSize released = node_size(order);
+  used_ -= released;
+
+  // Merge with the buddy for as long as it is free too.
+  while (order < max_order_) {
+    VkDeviceSize buddy = offset ^ node_size(order);
+    auto buddy_it = free_lists_[order].find(buddy);
+    if (buddy_it == free_lists_[order].end()) {
+      break;
+    }
+    free_lists_[order].erase(buddy_it);
+    offset = std::min(offset, buddy);
+    ++order;
+  }
+  free_lists_[order].insert(offset);
+  return released;
+}
+
+VkDeviceSize BuddyBlock::largest_free() const {
+  for (uint32_t order = max_order_ + 1; order-- > 0;) {
+    if (!free_lists_[order].empty()) {
+      return node_size(order);
+    }
+  }
+  return 0;
+}
+
+void GpuAllocator::init(VkPhysicalDevice physical_device, VkDevice device) {
+  device_ = device;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties_);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  max_allocation_count_ = properties.limits.maxMemoryAllocationCount;
+
+  pools_.clear();
+  pools_.resize(memory_properties_.memoryTypeCount * 2);
+}
+
+void GpuAllocator::destroy() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (allocation_count_ != 0) {
+    std::cerr << "GpuAllocator destroyed with " << allocation_count_
+              << " live allocations" << std::endl;
+  }
+  for (auto &pool : pools_) {
+    for (auto &block : pool.blocks) {
+      free_memory(block.memory);
+    }
+    pool.blocks.clear();
+  }
+  for (auto &[memory, info] : dedicated_) {
+    free_memory(memory);
+  }
+  dedicated_.clear();
+  allocation_count_ = 0;
+  requested_bytes_ = 0;
+}
+
+uint32_t GpuAllocator::find_memory_type(uint32_t type_bits,
+                                        VkMemoryPropertyFlags required,
+                                        VkMemoryPropertyFlags preferred) const {
+  std::optional<uint32_t> fallback;
+  for (uint32_t i = 0; i < memory_properties_.memoryTypeCount; ++i) {
+    VkMemoryPropertyFlags flags =
+        memory_properties_.memoryTypes[i].propertyFlags;
+    if (!(type_bits & (1u << i)) || (flags & required) != required) {
+      continue;
+    }
+    if ((flags & preferred) == preferred) {
+      return i;
+    }
+    if (!fallback) {
+      fallback = i;
+    }
+  }
+  if (!fallback) {
+    throw std::runtime_error{"Failed to find suitable memory type!"};
+  }
+  return *fallback;
+}
+
+VkDeviceSize GpuAllocator::block_size_for(uint32_t memory_type) const {
+  uint32_t heap = memory_properties_.memoryTypes[memory_type].heapIndex;
+  VkDeviceSize heap_size = memory_properties_.memoryHeaps[heap].size;
+  VkDeviceSize block_size = default_block_size;
+  while (block_size > min_block_size && block_size > heap_size / 8) {
+    block_size /= 2;
+  }
+  return block_size;
+}
+
+VkDeviceMemory GpuAllocator::allocate_memory(VkDeviceSize size,
+                                             uint32_t memory_type,
+                                             void **mapped) {
+  if (device_memory_count_ >= max_allocation_count_) {
+    throw std::runtime_error{"Exceeded maxMemoryAllocationCount!"};
+  }
+  VkMemoryAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = size;
+  allocInfo.memoryTypeIndex = memory_type;
+
+  VkDeviceMemory memory;
+  if (vkAllocateMemory(device_, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to allocate device memory!"};
+  }
+  *mapped = nullptr;
+  if (memory_type_flags(memory_type) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    if (vkMapMemory(device_, memory, 0, VK_WHOLE_SIZE, 0, mapped) !=
+        VK_SUCCESS) {
+      vkFreeMemory(device_, memory, nullptr);
+      throw std::runtime_error{"Failed to map device memory!"};
+    }
+  }
+  ++device_memory_count_;
+  return memory;
+}
+
+void GpuAllocator::free_memory(VkDeviceMemory memory) {
+  // Freeing implicitly unmaps.
+  vkFreeMemory(device_, memory, nullptr);
+  --device_memory_count_;
+}
+
+GpuAllocation GpuAllocator::allocate(const VkMemoryRequirements &requirements,
+                                     VkMemoryPropertyFlags required,
+                                     VkMemoryPropertyFlags preferred,
+                                     ResourceKind kind) {
+  uint32_t memory_type =
+      find_memory_type(requirements.memoryTypeBits, required, preferred);
+  VkDeviceSize block_size = block_size_for(memory_type);
+  VkDeviceSize node_size =
+      std::max(requirements.size, requirements.alignment);
+  // Lazily allocated memory is only backed once the GPU touches it, and a
+  // shared block would pin the whole block; such images get their own.
+  bool lazy = memory_type_flags(memory_type) &
+              VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+  if (lazy || node_size > block_size / 2) {
+    return allocate_dedicated(requirements, required, preferred, kind);
+  }
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  Pool &pool = pool_for(memory_type, kind);
+  Block *target = nullptr;
+  std::optional<VkDeviceSize> offset;
+  for (auto &block : pool.blocks) {
+    offset = block.buddy->allocate(node_size);
+    if (offset) {
+      target = &block;
+      break;
+    }
+  }
+  if (!target) {
+    Block block;
+    block.memory = allocate_memory(block_size, memory_type, &block.mapped);
+    block.buddy = std::make_unique<BuddyBlock>(block_size, min_node_size);
+    offset = block.buddy->allocate(node_size);
+    pool.blocks.push_back(std::move(block));
+    target = &pool.blocks.back();
+  }
+
+  GpuAllocation allocation;
+  allocation.memory = target->memory;
+  allocation.offset = *offset;
+  allocation.size = requirements.size;
+  allocation.mapped =
+      target->mapped ? static_cast<char *>(target->mapped) + *offset : nullptr;
+  allocation.memory_type = memory_type;
+  allocation.kind = kind;
+  ++allocation_count_;
+  requested_bytes_ += requirements.size;
+  return allocation;
+}
+
+GpuAllocation
+GpuAllocator::allocate_dedicated(const VkMemoryRequirements &requirements,
+                                 VkMemoryPropertyFlags required,
+                                 VkMemoryPropertyFlags preferred,
+                                 ResourceKind kind) {
+  uint32_t memory_type =
+      find_memory_type(requirements.memoryTypeBits, required, preferred);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  GpuAllocation allocation;
+  allocation.memory =
+      allocate_memory(requirements.size, memory_type, &allocation.mapped);
+  allocation.offset = 0;
+  allocation.size = requirements.size;
+  allocation.memory_type = memory_type;
+  allocation.kind = kind;
+  allocation.dedicated = true;
+  dedicated_[allocation.memory] = {requirements.size, allocation.mapped};
+  ++allocation_count_;
+  requested_bytes_ += requirements.size;
+  return allocation;
+}
+
+void GpuAllocator::free(GpuAllocation &allocation) {
+  if (allocation.memory == VK_NULL_HANDLE) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (allocation.dedicated) {
+    dedicated_.erase(allocation.memory);
+    free_memory(allocation.memory);
+  } else {
+    Pool &pool = pool_for(allocation.memory_type, allocation.kind);
+    auto it = std::find_if(
+        pool.blocks.begin(), pool.blocks.end(),
+        [&](const Block &block) { return block.memory == allocation.memory; });
+    if (it == pool.blocks.end()) {
+      throw std::logic_error{"Freeing memory from an unknown block!"};
+    }
+    it->buddy->free(allocation.offset);
+
+    // Keep a single empty block around so a free/allocate pattern at the
+    // edge of a block does not thrash vkAllocateMemory.
+    if (it->buddy->empty()) {
+      auto empty_blocks = std::count_if(
+          pool.blocks.begin(), pool.blocks.end(),
+          [](const Block &block) { return block.buddy->empty(); });
+      if (empty_blocks > 1) {
+        free_memory(it->memory);
+        pool.blocks.erase(it);
+      }
+    }
+  }
+  --allocation_count_;
+  requested_bytes_ -= allocation.size;
+  allocation = GpuAllocation{};
+}
+
+GpuAllocation GpuAllocator::create_buffer(VkDeviceSize size,
+                                          VkBufferUsageFlags usage,
+                                          VkMemoryPropertyFlags required,
+                                          VkMemoryPropertyFlags preferred,
+                                          VkBuffer &buffer) {
+  VkBufferCreateInfo bufferInfo{};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.usage = usage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (vkCreateBuffer(device_, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create buffer!"};
+  }
+
+  VkMemoryRequirements memRequirements;
+  vkGetBufferMemoryRequirements(device_, buffer, &memRequirements);
+  GpuAllocation allocation =
+      allocate(memRequirements, required, preferred, ResourceKind::Buffer);
+  vkBindBufferMemory(device_, buffer, allocation.memory, allocation.offset);
+  return allocation;
+}
+
+GpuAllocation GpuAllocator::create_image(const VkImageCreateInfo &image_info,
+                                         VkMemoryPropertyFlags required,
+                                         VkMemoryPropertyFlags preferred,
+                                         VkImage &image) {
+  if (vkCreateImage(device_, &image_info, nullptr, &image) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create image!"};
+  }
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device_, image, &memRequirements);
+  GpuAllocation allocation =
+      allocate(memRequirements, required, preferred,
+               image_info.tiling == VK_IMAGE_TILING_LINEAR
+                   ? ResourceKind::Buffer
+                   : ResourceKind::Image);
+  vkBindImageMemory(device_, image, allocation.memory, allocation.offset);
+  return allocation;
+}
+
+void GpuAllocator::destroy_buffer(VkBuffer buffer, GpuAllocation &allocation) {
+  vkDestroyBuffer(device_, buffer, nullptr);
+  free(allocation);
+}
+
+void GpuAllocator::destroy_image(VkImage image, GpuAllocation &allocation) {
+  vkDestroyImage(device_, image, nullptr);
+  free(allocation);
+}
+
+GpuMemoryStats GpuAllocator::stats() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  GpuMemoryStats stats;
+  stats.device_memory_count = device_memory_count_;
+  stats.max_device_memory_count = max_allocation_count_;
+  stats.allocation_count = allocation_count_;
+  stats.requested_bytes = requested_bytes_;
+
+  VkDeviceSize free_bytes = 0;
+  for (const auto &pool : pools_) {
+    for (const auto &block : pool.blocks) {
+      stats.reserved_bytes += block.buddy->size();
+      stats.used_bytes += block.buddy->used();
+      free_bytes += block.buddy->size() - block.buddy->used();
+      stats.largest_free_range =
+          std::max(stats.largest_free_range, block.buddy->largest_free());
+    }
+  }
+  for (const auto &[memory, info] : dedicated_) {
+    stats.reserved_bytes += info.size;
+    stats.used_bytes += info.size;
+  }
+  if (free_bytes > 0) {
+    stats.fragmentation =
+        1.0 - static_cast<double>(stats.largest_free_range) / free_bytes;
+  }
+  return stats;
+}
+
+void GpuAllocator::print_stats(std::ostream &out) const {
+  GpuMemoryStats total = stats();
+  out << std::fixed << std::setprecision(2) << "GPU memory: "
+      << total.allocation_count << " allocations in "
+      << total.device_memory_count << "/" << total.max_device_memory_count
+      << " device memory objects, " << to_mib(total.requested_bytes)
+      << " MiB requested, " << to_mib(total.used_bytes) << " MiB used, "
+      << to_mib(total.reserved_bytes) << " MiB reserved, fragmentation "
+      << total.fragmentation * 100.0 << "%\n";
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (uint32_t type = 0; type < memory_properties_.memoryTypeCount; ++type) {
+    size_t blocks = 0;
+    VkDeviceSize reserved = 0;
+    VkDeviceSize used = 0;
+    for (uint32_t kind = 0; kind < 2; ++kind) {
+      for (const auto &block : pools_[type * 2 + kind].blocks) {
+        ++blocks;
+        reserved += block.buddy->size();
+        used += block.buddy->used();
+      }
+    }
+    if (blocks == 0) {
+      continue;
+    }
+    out << "  memory type " << type << " (heap "
+        << memory_properties_.memoryTypes[type].heapIndex << ", flags 0x"
+        << std::hex << memory_properties_.memoryTypes[type].propertyFlags
+        << std::dec << "): " << blocks << " blocks, " << to_mib(used) << "/"
+        << to_mib(reserved) << " MiB used\n";
+  }
+}
+
+void LinearArena::init(GpuAllocator &allocator, VkDeviceSize capacity,
+                       uint32_t memory_type_bits,
+                       VkMemoryPropertyFlags required,
+                       VkMemoryPropertyFlags preferred, ResourceKind kind) {
+  VkMemoryRequirements requirements{};
+  requirements.size = capacity;
+  requirements.alignment = 1;
+  requirements.memoryTypeBits = memory_type_bits;
+  backing_ = allocator.allocate_dedicated(requirements, required, preferred,
+                                          kind);
+  head_ = 0;
+  peak_ = 0;
+}
+
+void LinearArena::destroy(GpuAllocator &allocator) {
+  allocator.free(backing_);
+  head_ = 0;
+}
+
+GpuAllocation LinearArena::allocate(VkDeviceSize size,
+                                    VkDeviceSize alignment) {
+  VkDeviceSize offset = align_up(head_, alignment);
+  if (offset + size > backing_.size) {
+    throw std::runtime_error{"Linear arena out of memory!"};
+  }
+  head_ = offset + size;
+  peak_ = std::max(peak_, head_);
+
+  GpuAllocation allocation = backing_;
+  allocation.offset = backing_.offset + offset;
+  allocation.size = size;
+  allocation.mapped =
+      backing_.mapped ? static_cast<char *>(backing_.mapped) + offset : nullptr;
+  return allocation;
+}
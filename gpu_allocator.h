@@ -0,0 +1,190 @@
+#ifndef GPU_ALLOCATOR_H
+#define GPU_ALLOCATOR_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Linear (buffer) and optimal-tiling (image) resources are kept in separate
+// blocks so bufferImageGranularity never has to be considered.
+enum class ResourceKind { Buffer, Image };
+
+// A range of device memory handed out by GpuAllocator or LinearArena.
+struct GpuAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  // Host pointer to offset for host-visible memory, nullptr otherwise.
+  void *mapped = nullptr;
+  uint32_t memory_type = 0;
+  ResourceKind kind = ResourceKind::Buffer;
+  // Owns its VkDeviceMemory instead of living in a shared block.
+  bool dedicated = false;
+};
+
+struct GpuMemoryStats {
+  // Live VkDeviceMemory objects and the device limit on them.
+  uint32_t device_memory_count = 0;
+  uint32_t max_device_memory_count = 0;
+  uint32_t allocation_count = 0;
+  // Bytes held in VkDeviceMemory objects.
+  VkDeviceSize reserved_bytes = 0;
+  // Bytes handed out, including power-of-two rounding.
+  VkDeviceSize used_bytes = 0;
+  // Bytes actually asked for.
+  VkDeviceSize requested_bytes = 0;
+  VkDeviceSize largest_free_range = 0;
+  // 1 - largest free range / free bytes: 0 when all free memory is one
+  // range, close to 1 when it is scattered in small pieces.
+  double fragmentation = 0.0;
+};
+
+// Buddy allocator over a power-of-two sized range. Offsets are aligned to
+// the size of the node they are served from.
+class BuddyBlock {
+public:
+  BuddyBlock(VkDeviceSize size, VkDeviceSize min_node_size);
+
+  std::optional<VkDeviceSize> allocate(VkDeviceSize size);
+  // Returns the node size that was released.
+  VkDeviceSize free(VkDeviceSize offset);
+
+  VkDeviceSize size() const { return size_; }
+  VkDeviceSize used() const { return used_; }
+  VkDeviceSize largest_free() const;
+  bool empty() const { return used_ == 0; }
+
+private:
+  uint32_t order_for(VkDeviceSize size) const;
+  VkDeviceSize node_size(uint32_t order) const {
+    return min_node_size_ << order;
+  }
+
+  VkDeviceSize size_;
+  VkDeviceSize min_node_size_;
+  uint32_t max_order_;
+  VkDeviceSize used_ = 0;
+  // Free node offsets per order, order 0 being min_node_size_.
+  std::vector<std::set<VkDeviceSize>> free_lists_;
+  // Order of every allocated node, by offset.
+  std::unordered_map<VkDeviceSize, uint32_t> allocated_;
+};
+
+// Sub-allocates long-lived resources from large per memory type blocks
+// using a buddy strategy. Requests larger than half a block get their own
+// VkDeviceMemory. Host-visible blocks are mapped once for their lifetime.
+class GpuAllocator {
+public:
+  GpuAllocator() = default;
+  GpuAllocator(const GpuAllocator &) = delete;
+  GpuAllocator &operator=(const GpuAllocator &) = delete;
+
+  void init(VkPhysicalDevice physical_device, VkDevice device);
+  // Frees every block. All allocations must have been released.
+  void destroy();
+
+  // Picks a memory type with all required properties, favouring one that
+  // also has the preferred ones.
+  uint32_t find_memory_type(uint32_t type_bits,
+                            VkMemoryPropertyFlags required,
+                            VkMemoryPropertyFlags preferred = 0) const;
+  VkMemoryPropertyFlags memory_type_flags(uint32_t memory_type) const {
+    return memory_properties_.memoryTypes[memory_type].propertyFlags;
+  }
+
+  GpuAllocation allocate(const VkMemoryRequirements &requirements,
+                         VkMemoryPropertyFlags required,
+                         VkMemoryPropertyFlags preferred, ResourceKind kind);
+  // Always creates a separate VkDeviceMemory, for arenas and large targets.
+  GpuAllocation allocate_dedicated(const VkMemoryRequirements &requirements,
+                                   VkMemoryPropertyFlags required,
+                                   VkMemoryPropertyFlags preferred,
+                                   ResourceKind kind);
+  void free(GpuAllocation &allocation);
+
+  // Creates the resource and binds it to freshly allocated memory.
+  GpuAllocation create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                              VkMemoryPropertyFlags required,
+                              VkMemoryPropertyFlags preferred,
+                              VkBuffer &buffer);
+  GpuAllocation create_image(const VkImageCreateInfo &image_info,
+                             VkMemoryPropertyFlags required,
+                             VkMemoryPropertyFlags preferred, VkImage &image);
+  void destroy_buffer(VkBuffer buffer, GpuAllocation &allocation);
+  void destroy_image(VkImage image, GpuAllocation &allocation);
+
+  GpuMemoryStats stats() const;
+  void print_stats(std::ostream &out) const;
+
+private:
+  struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    void *mapped = nullptr;
+    std::unique_ptr<BuddyBlock> buddy;
+  };
+  struct Pool {
+    std::vector<Block> blocks;
+  };
+
+  Pool &pool_for(uint32_t memory_type, ResourceKind kind) {
+    return pools_[memory_type * 2 + (kind == ResourceKind::Image ? 1 : 0)];
+  }
+  VkDeviceSize block_size_for(uint32_t memory_type) const;
+  VkDeviceMemory allocate_memory(VkDeviceSize size, uint32_t memory_type,
+                                 void **mapped);
+  void free_memory(VkDeviceMemory memory);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties_{};
+  uint32_t max_allocation_count_ = 0;
+
+  mutable std::mutex mutex_;
+  // Two pools per memory type, see pool_for.
+  std::vector<Pool> pools_;
+  struct DedicatedInfo {
+    VkDeviceSize size;
+    void *mapped;
+  };
+  std::unordered_map<VkDeviceMemory, DedicatedInfo> dedicated_;
+  uint32_t device_memory_count_ = 0;
+  uint32_t allocation_count_ = 0;
+  VkDeviceSize requested_bytes_ = 0;
+};
+
+// Bump allocator over one dedicated allocation, for data that lives for a
+// single frame. reset() releases everything at once, typically after the
+// frame's fence has signalled.
+class LinearArena {
+public:
+  LinearArena() = default;
+  LinearArena(const LinearArena &) = delete;
+  LinearArena &operator=(const LinearArena &) = delete;
+
+  void init(GpuAllocator &allocator, VkDeviceSize capacity,
+            uint32_t memory_type_bits, VkMemoryPropertyFlags required,
+            VkMemoryPropertyFlags preferred, ResourceKind kind);
+  void destroy(GpuAllocator &allocator);
+
+  // Throws when the arena is full.
+  GpuAllocation allocate(VkDeviceSize size, VkDeviceSize alignment);
+  void reset() { head_ = 0; }
+
+  VkDeviceMemory memory() const { return backing_.memory; }
+  VkDeviceSize capacity() const { return backing_.size; }
+  VkDeviceSize used() const { return head_; }
+  VkDeviceSize peak() const { return peak_; }
+
+private:
+  GpuAllocation backing_;
+  VkDeviceSize head_ = 0;
+  VkDeviceSize peak_ = 0;
+};
+
+#endif // GPU_ALLOCATOR_H
@@ -2,21 +2,46 @@
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <map>
+#include <memory>
+#include <numeric>
 #include <optional>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <config.h>
+#include <shader_bundle.h>
+
+#include "deletion_queue.h"
+#include "descriptor_pools.h"
+#include "device_benchmark.h"
+#include "gpu_allocator.h"
+#include "pipeline_registry.h"
+#include "profiler.h"
+#include "queue_timeline.h"
+#include "shader_watcher.h"
+#include "staging_ring.h"
+#include "startup_scheduler.h"
+#include "thread_pool.h"
+#include "uniform_ring.h"
 
 const std::vector<const char *> validation_layers = {
     "VK_LAYER_KHRONOS_validation"};
@@ -53,12 +78,57 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance,
   }
 }
 
+// 64-bit FNV-1a, used to checksum frames and files.
+uint64_t fnv1a64(const void *data, size_t size,
+                 uint64_t hash = 14695981039346656037ull) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Header written in front of the VkPipelineCache blob on disk. The blob is
+// only handed to the driver when every field matches the current device.
+// It is written as raw bytes, so it has no implicit padding and must be
+// zero-initialized before it is filled in.
+struct PipelineCacheFileHeader {
+  static constexpr uint32_t magic_value = 0x46435054; // "TPCF"
+  static constexpr uint32_t current_version = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t vendor_id;
+  uint32_t device_id;
+  uint32_t driver_version;
+  uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+  // Pads data_size to 8 bytes; always 0.
+  uint32_t reserved;
+  uint64_t data_size;
+  uint64_t data_checksum;
+  // Pipeline creation time measured when the cache was first built, so a
+  // warm start can report how much it saved.
+  uint64_t cold_create_us;
+};
+static_assert(sizeof(PipelineCacheFileHeader) ==
+                  6 * sizeof(uint32_t) + VK_UUID_SIZE + 3 * sizeof(uint64_t),
+              "PipelineCacheFileHeader must not contain padding");
+
 struct QueueFamilyIndices {
   std::optional<uint32_t> graphicsFamily;
   std::optional<uint32_t> presentFamily;
-
-  bool isComplete() {
-    return graphicsFamily.has_value() && presentFamily.has_value();
+  // A compute family without graphics when the device has one, so compute
+  // runs alongside graphics work. Otherwise graphicsFamily, if it supports
+  // compute.
+  std::optional<uint32_t> computeFamily;
+  // A transfer-only family when the device has one, otherwise
+  // graphicsFamily.
+  std::optional<uint32_t> transferFamily;
+
+  // Headless rendering never presents, so it only needs a graphics queue.
+  bool isComplete(bool needs_present = true) {
+    return graphicsFamily.has_value() &&
+           (!needs_present || presentFamily.has_value());
   }
 };
 
@@ -68,16 +138,352 @@ struct SwapchainSupportDetails {
   std::vector<VkPresentModeKHR> presentModes;
 };
 
+struct Vertex {
+  float pos[2];
+  float color[3];
+
+  static VkVertexInputBindingDescription getBindingDescription() {
+    VkVertexInputBindingDescription bindingDescription{};
+    bindingDescription.binding = 0;
+    bindingDescription.stride = sizeof(Vertex);
+    bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    return bindingDescription;
+  }
+
+  static std::vector<VkVertexInputAttributeDescription>
+  getAttributeDescriptions() {
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions(2);
+    attributeDescriptions[0].binding = 0;
+    attributeDescriptions[0].location = 0;
+    attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
+    attributeDescriptions[0].offset = offsetof(Vertex, pos);
+
+    attributeDescriptions[1].binding = 0;
+    attributeDescriptions[1].location = 1;
+    attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+    attributeDescriptions[1].offset = offsetof(Vertex, color);
+    return attributeDescriptions;
+  }
+};
+
+// Per-instance attributes, read from binding 1 at instance rate.
+struct InstanceData {
+  // xy offset in clip space, uniform scale and rotation in radians.
+  float transform[4];
+  // Multiplied with the vertex color.
+  float color[3];
+  // Distance from the viewer in [0, 1), 0 being nearest. Read together
+  // with color as one vec4 attribute.
+  float depth;
+
+  static VkVertexInputBindingDescription getBindingDescription() {
+    VkVertexInputBindingDescription bindingDescription{};
+    bindingDescription.binding = 1;
+    bindingDescription.stride = sizeof(InstanceData);
+    bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+    return bindingDescription;
+  }
+
+  static std::vector<VkVertexInputAttributeDescription>
+  getAttributeDescriptions() {
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions(2);
+    attributeDescriptions[0].binding = 1;
+    attributeDescriptions[0].location = 2;
+    attributeDescriptions[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributeDescriptions[0].offset = offsetof(InstanceData, transform);
+
+    // rgb color, w depth.
+    attributeDescriptions[1].binding = 1;
+    attributeDescriptions[1].location = 3;
+    attributeDescriptions[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributeDescriptions[1].offset = offsetof(InstanceData, color);
+    return attributeDescriptions;
+  }
+};
+
+struct Mesh {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+};
+
+// All meshes share one vertex and one index buffer, a mesh is the range it
+// occupies in them.
+struct MeshRange {
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  int32_t vertexOffset;
+  // Radius of a circle around the origin holding every vertex.
+  float radius;
+};
+
+// Uniform block of shaders/shader.vert, one per viewport and frame.
+struct ViewUniforms {
+  // Applied after the instance transform: xy offset and uniform scale in
+  // clip space, w unused.
+  float camera[4];
+};
+
+// Push constants of shaders/animate.comp.
+struct AnimateParams {
+  uint32_t count;
+  float time;
+};
+
+// Push constants of shaders/cull.comp.
+struct CullParams {
+  float camera[4];
+  uint32_t instanceCount;
+  uint32_t meshCount;
+  // 0 culls the instances, 1 compacts the draws.
+  uint32_t pass;
+};
+
+const Mesh triangle_mesh = {{{{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+                             {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+                             {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}}},
+                            {0, 1, 2}};
+
+// How frames are handed to the presentation engine.
+enum class PresentPolicy {
+  // MAILBOX when available, FIFO otherwise, one spare swapchain image.
+  Mailbox,
+  // IMMEDIATE (or MAILBOX) with as few images and frames in flight as
+  // possible. May tear with IMMEDIATE.
+  LowLatency,
+  // FIFO: vsynced, the CPU and GPU idle once a frame is queued.
+  PowerSaving,
+  // FIFO_RELAXED: vsynced, but a late frame is shown immediately.
+  FifoRelaxed,
+};
+
+struct AppConfig {
+  // Number of frames the CPU may record ahead of the GPU. 0 lets the
+  // present policy choose.
+  uint32_t frames_in_flight = 0;
+  // Stop after this many frames, 0 runs until the window is closed.
+  uint32_t frame_count = 0;
+  // Measure frame time for 1, 2 and 3 frames in flight and exit.
+  bool frames_in_flight_sweep = false;
+  // Render into offscreen images without a window or presentation engine.
+  bool headless = false;
+  // Write every frame read back as a PPM file into this directory. Implies
+  // headless.
+  std::string dump_dir;
+  // Print a checksum of every frame read back. Implies headless.
+  bool print_checksums = false;
+  // File the pipeline cache is loaded from at startup and saved to on exit.
+  std::string pipeline_cache_file = PIPELINE_CACHE_FILE;
+  // Print GPU memory usage and fragmentation on exit.
+  bool memory_stats = false;
+  // Instances of every mesh, laid out on a grid. A single instance draws
+  // the mesh untransformed.
+  uint32_t instance_count = 1;
+  // Measure frame time for 1 to 10^6 instances and exit.
+  bool instance_sweep = false;
+  // Worker threads recording secondary command buffers. 0 records
+  // everything inline on the main thread.
+  uint32_t record_threads = 0;
+  // Measure recording time inline and with 1, 2, 4, ... worker threads
+  // and exit.
+  bool record_threads_sweep = false;
+  // Chrome trace JSON file receiving CPU and GPU frame timings.
+  std::string trace_file;
+  PresentPolicy present_policy = PresentPolicy::Mailbox;
+  // CPU-side frame rate cap, 0 disables it.
+  double fps_limit = 0.0;
+  // Print a frame time histogram with the frame stats.
+  bool frame_histogram = false;
+  // Draw the scene this many times side by side, one viewport per tile.
+  uint32_t viewport_count = 1;
+  // Pipeline variant to draw with once it has compiled in the background.
+  PipelineKey pipeline_variant;
+  // Recompile shaders when their sources change and swap the pipelines
+  // in without restarting.
+  bool watch_shaders = false;
+  // Generate and animate the instances with a compute shader every frame
+  // instead of uploading them once from the CPU.
+  bool gpu_animate = false;
+  // Submit uploads and compute to the graphics queue even when the device
+  // has dedicated transfer or compute queues.
+  bool single_queue = false;
+  // Samples per pixel, lowered to what the device supports. 0 picks the
+  // highest supported count.
+  uint32_t msaa_samples = 1;
+  // Order CPU-generated instances nearest first, so the depth test rejects
+  // hidden fragments before they are shaded.
+  bool sort_front_to_back = false;
+  // Cull the instances against the view in a compute pass and draw the
+  // survivors with indirect draws.
+  bool gpu_cull = false;
+  // Camera scale of every viewport; above 1 zooms into the grid.
+  float zoom = 1.f;
+  // Pick the fastest of several suitable devices by a short rendering
+  // benchmark instead of by device type and limits.
+  bool device_benchmark = false;
+  // File benchmark results are kept in between runs.
+  std::string device_benchmark_file = DEVICE_BENCHMARK_FILE;
+  // Measure a fixed number of headless frames after a warmup and write the
+  // frame time statistics to this JSON file.
+  std::string benchmark_file;
+};
+
+// Wall-clock frame times, measured between consecutive drawFrame calls,
+// and the CPU time spent recording each frame's command buffers.
+struct FrameStats {
+  std::vector<double> frame_times_ms;
+  double record_ms_total = 0.0;
+  uint64_t recorded_frames = 0;
+
+  void add(double ms) { frame_times_ms.push_back(ms); }
+  void add_record(double ms) {
+    record_ms_total += ms;
+    ++recorded_frames;
+  }
+  void clear() {
+    frame_times_ms.clear();
+    record_ms_total = 0.0;
+    recorded_frames = 0;
+  }
+
+  double mean_record_ms() const {
+    return recorded_frames > 0 ? record_ms_total / recorded_frames : 0.0;
+  }
+
+  double mean_ms() const {
+    if (frame_times_ms.empty()) {
+      return 0.0;
+    }
+    return std::accumulate(frame_times_ms.begin(), frame_times_ms.end(), 0.0) /
+           frame_times_ms.size();
+  }
+
+  double fps() const {
+    double mean = mean_ms();
+    return mean > 0.0 ? 1000.0 / mean : 0.0;
+  }
+
+  // Nearest-rank percentile, p in [0, 100].
+  double percentile_ms(double p) const {
+    if (frame_times_ms.empty()) {
+      return 0.0;
+    }
+    std::vector<double> sorted = frame_times_ms;
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    rank = std::clamp<size_t>(rank, 1, sorted.size());
+    std::nth_element(sorted.begin(), sorted.begin() + rank - 1, sorted.end());
+    return sorted[rank - 1];
+  }
+
+  void print_histogram(std::ostream &out) const {
+    // Bucket edges around common refresh intervals.
+    static const double edges_ms[] = {2.0,  4.0,  7.0,  8.4,  11.2, 16.8,
+                                      20.0, 33.4, 50.0, 100.0};
+    constexpr size_t bucket_count = std::size(edges_ms) + 1;
+    size_t counts[bucket_count] = {};
+    for (double ms : frame_times_ms) {
+      size_t bucket = std::upper_bound(std::begin(edges_ms),
+                                       std::end(edges_ms), ms) -
+                      std::begin(edges_ms);
+      ++counts[bucket];
+    }
+    size_t peak = *std::max_element(std::begin(counts), std::end(counts));
+    for (size_t i = 0; i < bucket_count; ++i) {
+      std::ostringstream label;
+      label << std::fixed << std::setprecision(1);
+      if (i == 0) {
+        label << "< " << edges_ms[0];
+      } else if (i == bucket_count - 1) {
+        label << ">= " << edges_ms[i - 1];
+      } else {
+        label << edges_ms[i - 1] << "-" << edges_ms[i];
+      }
+      size_t bar = peak > 0 ? counts[i] * 40 / peak : 0;
+      out << std::setw(12) << label.str() << " ms | " << std::setw(7)
+          << counts[i] << " " << std::string(bar, '#') << "\n";
+    }
+  }
+};
+
+// Caps the frame rate by sleeping until the next frame slot. The deadline
+// advances by a fixed period so pacing does not drift; if the loop falls
+// more than a frame behind it restarts from now instead of bursting.
+class FrameLimiter {
+public:
+  explicit FrameLimiter(double fps)
+      : period_{fps > 0.0 ? std::chrono::duration_cast<
+                                std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double>(1.0 / fps))
+                          : std::chrono::steady_clock::duration::zero()},
+        next_{std::chrono::steady_clock::now()} {}
+
+  void wait() {
+    if (period_ == std::chrono::steady_clock::duration::zero()) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_) {
+      // Sleep most of the way and spin the rest, sleep alone overshoots by
+      // up to a scheduler tick.
+      auto spin = std::chrono::microseconds{500};
+      if (next_ - now > spin) {
+        std::this_thread::sleep_until(next_ - spin);
+      }
+      while (std::chrono::steady_clock::now() < next_) {
+      }
+      next_ += period_;
+    } else if (now - next_ > period_) {
+      next_ = now + period_;
+    } else {
+      next_ += period_;
+    }
+  }
+
+private:
+  std::chrono::steady_clock::duration period_;
+  std::chrono::steady_clock::time_point next_;
+};
+
 class HelloTriangleApplication {
 public:
+  explicit HelloTriangleApplication(const AppConfig &config)
+      : config{config} {}
+
   void run() {
-    init_window();
     init_vulkan();
     main_loop();
     cleanup();
   }
 
 private:
+  // Frames recorded by the sweep for each frames-in-flight setting.
+  static constexpr uint32_t sweep_warmup_frames = 60;
+  static constexpr uint32_t sweep_default_frames = 1000;
+  // Headless mode has no window to close, so it stops after this many frames
+  // unless --frames says otherwise.
+  static constexpr uint32_t headless_default_frames = 100;
+  // Frames --benchmark skips and then measures, unless --frames says
+  // otherwise.
+  static constexpr uint32_t benchmark_warmup_frames = 60;
+  static constexpr uint32_t benchmark_default_frames = 1000;
+  static constexpr VkFormat offscreen_format = VK_FORMAT_R8G8B8A8_UNORM;
+  static constexpr VkDeviceSize staging_ring_size = 16ull << 20;
+  // Bytes of uniform data each frame may push.
+  static constexpr VkDeviceSize uniform_ring_frame_size = 256 << 10;
+  // Size of each per-frame descriptor pool. With --gpu-cull a frame
+  // allocates one cull set of four storage buffers. Room for 16 of them
+  // leaves headroom for more per-frame sets without a second pool;
+  // DescriptorPools takes another one if it runs out anyway.
+  static constexpr uint32_t frame_descriptor_sets = 16;
+  static constexpr uint32_t frame_storage_descriptors =
+      4 * frame_descriptor_sets;
+  static constexpr uint32_t max_sweep_instances = 1000000;
+  // local_size_x of shaders/animate.comp.
+  static constexpr uint32_t animate_group_size = 64;
+  // local_size_x of shaders/cull.comp.
+  static constexpr uint32_t cull_group_size = 64;
+
+  const AppConfig config;
+
   const uint32_t window_width = 800;
   const uint32_t window_height = 600;
 
@@ -92,84 +498,958 @@ private:
   VkDevice device;
   VkQueue graphics_queue;
   VkQueue present_queue;
+  // Same as graphics_queue when the device has no dedicated family for them.
+  VkQueue compute_queue;
+  VkQueue transfer_queue;
+  // Resolved once when the device is created.
+  QueueFamilyIndices queueFamilies;
+  // Whether compute runs on its own queue family, handing its results to
+  // graphics through ownership transfers.
+  bool async_compute = false;
+  // One timeline per distinct queue. Roles sharing a queue share its
+  // timeline, so its values order all work on that queue.
+  std::vector<std::unique_ptr<QueueTimeline>> queueTimelines;
+  QueueTimeline *graphicsTimeline = nullptr;
+  QueueTimeline *computeTimeline = nullptr;
+  QueueTimeline *transferTimeline = nullptr;
+
+  GpuAllocator allocator;
+  Profiler profiler;
 
   VkSwapchainKHR swapchain;
   std::vector<VkImage> swapchain_images;
   VkFormat swapchainImageFormat;
   VkExtent2D swapchainExtent;
+  VkPresentModeKHR swapchainPresentMode = VK_PRESENT_MODE_FIFO_KHR;
   std::vector<VkImageView> swapchain_image_views;
+  // Set by the GLFW resize callback, cleared by recreate_swapchain.
+  bool framebufferResized = false;
+
+  // Objects replaced at runtime, such as old swapchains and pipeline
+  // generations, tagged with the last graphics timeline value that may use
+  // them. Drained once per frame instead of idling the device.
+  DeletionQueue deletions;
+  // Destroys a replaced swapchain and its images' objects. Without
+  // VK_EXT_swapchain_maintenance1 present fences nothing reports when the
+  // presents queued on the old swapchain are done; acquiring an image from
+  // the new swapchain is the point where the presentation engine has moved
+  // on to it. Only then do these go to deletions, tagged with the frames
+  // submitted so far.
+  std::vector<std::function<void()>> retiredSwapchains;
+  // Headless mode renders into these instead of swapchain images.
+  std::vector<GpuAllocation> offscreen_image_memory;
+
+  // Attachments that only live inside the render pass, one of each shared
+  // by all framebuffers: the depth buffer and, with MSAA, the multisampled
+  // color image resolved into the swapchain image at the end of the pass.
+  // They are never stored, so they are transient and lazily allocated
+  // where the device allows; tiled GPUs then keep them in tile memory only.
+  struct RenderTarget {
+    VkImage image = VK_NULL_HANDLE;
+    GpuAllocation memory;
+    VkImageView view = VK_NULL_HANDLE;
+  };
+  VkSampleCountFlagBits msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+  RenderTarget msaaTarget;
+  // Reverse-Z: cleared to 0 at the far plane, nearer fragments pass with
+  // VK_COMPARE_OP_GREATER.
+  VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+  RenderTarget depthTarget;
 
   VkRenderPass renderPass;
+  // Set 0 of pipelineLayout: the uniform ring as a dynamic uniform buffer.
+  VkDescriptorSetLayout uniformSetLayout = VK_NULL_HANDLE;
   VkPipelineLayout pipelineLayout;
-  VkPipeline graphicsPipeline;
+  std::unique_ptr<ThreadPool> compile_workers;
+  PipelineRegistry pipelines;
+  // Resolved once per frame from config.pipeline_variant, bound by every
+  // recording thread.
+  VkPipeline graphicsPipeline = VK_NULL_HANDLE;
+  // Whether LINE and POINT polygon modes can be used.
+  bool fill_mode_non_solid = false;
+  // Set with --watch-shaders.
+  std::unique_ptr<ShaderWatcher> shader_watcher;
+
+  // shaders/animate.comp, writing the instances as a storage buffer. Only
+  // created with --gpu-animate.
+  VkDescriptorSetLayout computeSetLayout = VK_NULL_HANDLE;
+  VkPipelineLayout computePipelineLayout = VK_NULL_HANDLE;
+  VkPipeline computePipeline = VK_NULL_HANDLE;
+  // For the animation command buffers when async_compute is set.
+  VkCommandPool computeCommandPool = VK_NULL_HANDLE;
+  // With --gpu-animate every frame in flight draws instances of its own,
+  // so the compute pass of one frame can overlap the draws of another.
+  struct AnimationSlot {
+    VkBuffer instanceBuffer = VK_NULL_HANDLE;
+    GpuAllocation instanceMemory;
+    VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+    // Submitted to compute_queue, only used when async_compute is set.
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+  };
+  std::vector<AnimationSlot> animationSlots;
+  VkDescriptorPool animationDescriptorPool = VK_NULL_HANDLE;
+
+  // shaders/cull.comp and its inputs, only created with --gpu-cull. Each
+  // frame in flight has its own visible instances and draws, written by
+  // the frame's culling pass on the graphics queue.
+  VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+  VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+  VkPipeline cullPipeline = VK_NULL_HANDLE;
+  // MeshRange::radius of every scene mesh.
+  VkBuffer meshBoundsBuffer = VK_NULL_HANDLE;
+  GpuAllocation meshBoundsMemory;
+  struct CullSlot {
+    // Room for every instance once per mesh.
+    VkBuffer visibleBuffer = VK_NULL_HANDLE;
+    GpuAllocation visibleMemory;
+    // The draw count, then one draw per mesh and the compacted draw list,
+    // see shaders/cull.comp.
+    VkBuffer drawBuffer = VK_NULL_HANDLE;
+    GpuAllocation drawMemory;
+  };
+  std::vector<CullSlot> cullSlots;
+  // Whether several draws can come from one indirect call, and whether
+  // their number can come from a buffer.
+  bool multi_draw_indirect = false;
+  bool draw_indirect_count = false;
+
+  VkPipelineCache pipelineCache;
+  // Whether pipelineCache was seeded from a valid file.
+  bool pipeline_cache_warm = false;
+  uint64_t cold_pipeline_create_us = 0;
 
   std::vector<VkFramebuffer> swapchainFramebuffers;
 
   VkCommandPool commandPool;
-  VkCommandBuffer commandBuffer;
 
-  VkSemaphore imageAvailableSemaphore;
-  VkSemaphore renderFinishedSemaphore;
-  VkFence inFlightFence;
+  // Per-view data of every frame in flight, and the pools the descriptor
+  // sets written each frame come from.
+  UniformRing uniforms;
+  DescriptorPools frameDescriptors;
+  // One set per frame slot, written once with the slot's uniform buffer;
+  // frames only change the dynamic offsets.
+  VkDescriptorPool uniformDescriptorPool = VK_NULL_HANDLE;
+  std::vector<VkDescriptorSet> frameUniformSets;
+  // The dynamic offset of every viewport's data in this frame.
+  std::vector<uint32_t> viewUniformOffsets;
+
+  StagingRing staging;
+  VkBuffer vertexBuffer;
+  GpuAllocation vertexBufferMemory;
+  VkBuffer indexBuffer;
+  GpuAllocation indexBufferMemory;
+  std::vector<MeshRange> scene_meshes;
+  // Static instances, unused with --gpu-animate.
+  VkBuffer instanceBuffer;
+  GpuAllocation instanceBufferMemory;
+  uint32_t instance_count = 0;
+
+  // One slot per frame in flight, indexed by currentFrame.
+  uint32_t max_frames_in_flight = 0;
+  uint32_t currentFrame = 0;
+  std::vector<VkCommandBuffer> commandBuffers;
+  std::vector<VkSemaphore> imageAvailableSemaphores;
+  // Graphics timeline value of the last submission of each slot.
+  std::vector<uint64_t> frameValues;
+  // Graphics timeline value of the last frame rendering into each
+  // swapchain image.
+  std::vector<uint64_t> imageValues;
+  // Signaled by the frame rendering into each swapchain image and waited
+  // on by its present. Indexed by image, not frame slot: nothing tells
+  // when a present has consumed its semaphore, but an image can only be
+  // acquired again after that, so the image's semaphore is free to signal
+  // again (VUID-vkQueueSubmit-pSignalSemaphores-00067). Windowed only.
+  std::vector<VkSemaphore> renderFinishedSemaphores;
+  // What the frame being recorded waits on: image acquisition, uploads
+  // and the compute pass. Reused every frame.
+  std::vector<QueueTimeline::Wait> frameWaits;
+
+  // Parallel recording: recordSlots[frame][slice] is owned by whichever
+  // worker records that slice of the scene, so no pool is ever used by two
+  // threads at once. The pools are reset as a whole every frame.
+  struct RecordSlot {
+    VkCommandPool pool;
+    VkCommandBuffer commandBuffer;
+  };
+  std::unique_ptr<ThreadPool> record_workers;
+  std::vector<std::vector<RecordSlot>> recordSlots;
+
+  // Headless readback ring, one host-visible buffer per frame in flight.
+  // readbackFrames holds the number of the frame copied into each buffer
+  // that has not been consumed yet.
+  std::vector<VkBuffer> readbackBuffers;
+  std::vector<GpuAllocation> readbackMemory;
+  std::vector<std::optional<uint64_t>> readbackFrames;
+  VkDeviceSize readback_size = 0;
+  uint64_t frame_number = 0;
+  uint64_t frames_read_back = 0;
+  uint64_t last_checksum = 0;
+
+  FrameStats frame_stats;
 
   void init_window() {
-    glfwInit();
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
     window = glfwCreateWindow(window_width, window_height, "Vulkan", nullptr,
                               nullptr);
+    glfwSetWindowUserPointer(window, this);
+    glfwSetFramebufferSizeCallback(window, framebuffer_resize_callback);
   }
 
+  static void framebuffer_resize_callback(GLFWwindow *window, int, int) {
+    auto *app = static_cast<HelloTriangleApplication *>(
+        glfwGetWindowUserPointer(window));
+    app->framebufferResized = true;
+  }
+
+  // Brings up the window and everything Vulkan needs for the first frame.
+  // Stages that do not depend on each other overlap: the instance is created
+  // while the window opens, the pipeline cache file is read while the
+  // swapchain is built, and the pipelines compile while the framebuffers,
+  // buffers and per-frame resources are created.
   void init_vulkan() {
-    create_instance();
-    setup_debug_messenger();
-    create_surface();
-    pick_physical_device();
-    create_logical_device();
-    create_swapchain();
-    create_image_views();
-    create_render_pass();
-    create_graphic_pipeline();
-    create_framebuffers();
-    create_command_pool();
-    create_command_buffer();
+    if (!config.headless) {
+      // Must happen on the main thread, and before the instance asks GLFW
+      // for its extensions.
+      startup.run("glfw init", [] { glfwInit(); });
+    }
+    startup.start("instance", [this] {
+      create_instance();
+      setup_debug_messenger();
+    });
+    if (!config.headless) {
+      startup.run("window", [this] { init_window(); });
+    }
+    startup.join("instance");
+    if (!config.headless) {
+      startup.run("surface", [this] { create_surface(); });
+    }
+    startup.run("device", [this] {
+      pick_physical_device();
+      msaa_samples = choose_msaa_samples();
+      depthFormat = choose_depth_format();
+      create_logical_device();
+      create_uniform_set_layout();
+      allocator.init(physical_device, device);
+      profiler.init(physical_device, device,
+                    findQueueFamilies(physical_device).graphicsFamily.value());
+      if (!config.trace_file.empty()) {
+        profiler.open_trace(config.trace_file);
+      }
+    });
+    startup.start("pipeline cache", [this] { create_pipeline_cache(); });
+    startup.run("swapchain", [this] {
+      if (config.headless) {
+        create_offscreen_targets();
+      } else {
+        create_swapchain();
+      }
+      create_image_views();
+      create_render_targets();
+      create_render_pass();
+    });
+    startup.join("pipeline cache");
+    // Both only read the device, render pass and pipeline cache; the cache
+    // is internally synchronized.
+    startup.start("graphics pipeline", [this] { create_graphic_pipeline(); });
+    startup.start("compute pipelines", [this] {
+      if (config.gpu_animate) {
+        create_compute_pipeline();
+      }
+      if (config.gpu_cull) {
+        create_cull_pipeline();
+      }
+    });
+    startup.run("framebuffers", [this] { create_framebuffers(); });
+    startup.run("scene buffers", [this] {
+      create_command_pool();
+      staging.init(device, allocator, *transferTimeline,
+                   queueFamilies.graphicsFamily.value(), staging_ring_size);
+      create_scene_buffers();
+      create_instance_buffer(config.instance_count);
+    });
+    // GPU-driven frames record a few commands whatever the instance count,
+    // there is nothing to spread over threads.
+    if (config.record_threads > 0 && !config.gpu_cull) {
+      record_workers = std::make_unique<ThreadPool>(config.record_threads);
+    }
+    // The animation slots allocate from the compute set layout.
+    startup.join("compute pipelines");
+    startup.run("frame resources",
+                [this] { create_frame_resources(config.frames_in_flight); });
+    if (!config.headless) {
+      std::cout << "Present mode: " << present_mode_name(swapchainPresentMode)
+                << ", swapchain images: " << swapchain_images.size()
+                << ", frames in flight: " << max_frames_in_flight
+                << std::endl;
+    }
+    startup.join("graphics pipeline");
+  }
+
+  // Packs the scene's meshes into device-local vertex and index buffers,
+  // uploaded in one batch through the staging ring.
+  void create_scene_buffers() {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    scene_meshes.clear();
+    for (const Mesh *mesh : {&triangle_mesh}) {
+      MeshRange range{};
+      range.firstIndex = static_cast<uint32_t>(indices.size());
+      range.indexCount = static_cast<uint32_t>(mesh->indices.size());
+      range.vertexOffset = static_cast<int32_t>(vertices.size());
+      range.radius = 0.f;
+      for (const Vertex &vertex : mesh->vertices) {
+        range.radius = std::max(range.radius,
+                                std::hypot(vertex.pos[0], vertex.pos[1]));
+      }
+      scene_meshes.push_back(range);
+      vertices.insert(vertices.end(), mesh->vertices.begin(),
+                      mesh->vertices.end());
+      indices.insert(indices.end(), mesh->indices.begin(),
+                     mesh->indices.end());
+    }
+
+    VkDeviceSize vertexBufferSize = sizeof(vertices[0]) * vertices.size();
+    vertexBufferMemory = allocator.create_buffer(
+        vertexBufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, vertexBuffer);
+    staging.upload(vertexBuffer, 0, vertices.data(), vertexBufferSize);
+
+    VkDeviceSize indexBufferSize = sizeof(indices[0]) * indices.size();
+    indexBufferMemory = allocator.create_buffer(
+        indexBufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, indexBuffer);
+    staging.upload(indexBuffer, 0, indices.data(), indexBufferSize);
+
+    if (config.gpu_cull) {
+      std::vector<float> radii;
+      for (const auto &mesh : scene_meshes) {
+        radii.push_back(mesh.radius);
+      }
+      VkDeviceSize boundsSize = sizeof(radii[0]) * radii.size();
+      meshBoundsMemory = allocator.create_buffer(
+          boundsSize,
+          VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, meshBoundsBuffer);
+      staging.upload(meshBoundsBuffer, 0, radii.data(), boundsSize);
+    }
+
+    // Submitted ahead of the first frame, which acquires the buffers when
+    // the copies ran on a transfer queue.
+    staging.flush();
+  }
+
+  void create_instance_buffer(uint32_t count) {
+    instance_count = count;
+    create_cull_buffers();
+    if (config.gpu_animate) {
+      // Before the frame resources exist this creates nothing, they create
+      // the buffers themselves.
+      create_animation_buffers();
+      return;
+    }
+    std::vector<InstanceData> instances = generate_instances(count);
+    if (config.sort_front_to_back) {
+      // Instances are rasterized in buffer order.
+      std::stable_sort(instances.begin(), instances.end(),
+                       [](const InstanceData &a, const InstanceData &b) {
+                         return a.depth < b.depth;
+                       });
+    }
+    VkDeviceSize bufferSize = sizeof(instances[0]) * instances.size();
+    // Also read by the culling pass.
+    instanceBufferMemory = allocator.create_buffer(
+        bufferSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, instanceBuffer);
+    staging.upload(instanceBuffer, 0, instances.data(), bufferSize);
+    staging.flush();
+  }
+
+  // Must only be called while the device is idle.
+  void destroy_instance_buffer() {
+    destroy_cull_buffers();
+    if (config.gpu_animate) {
+      destroy_animation_buffers();
+    } else {
+      allocator.destroy_buffer(instanceBuffer, instanceBufferMemory);
+    }
+    instance_count = 0;
+  }
+
+  // One instance buffer per animation slot, filled by the compute pass at
+  // the start of the slot's frame.
+  // The descriptor sets get a pool of their own, so replacing the buffers
+  // can leave the old sets to frames still in flight.
+  void create_animation_buffers() {
+    if (animationSlots.empty()) {
+      return;
+    }
+    uint32_t slotCount = static_cast<uint32_t>(animationSlots.size());
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = slotCount;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = slotCount;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    if (vkCreateDescriptorPool(device, &poolInfo, nullptr,
+                               &animationDescriptorPool) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor pool!"};
+    }
+
+    VkDeviceSize bufferSize = sizeof(InstanceData) * instance_count;
+    for (auto &slot : animationSlots) {
+      VkDescriptorSetAllocateInfo allocInfo{};
+      allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+      allocInfo.descriptorPool = animationDescriptorPool;
+      allocInfo.descriptorSetCount = 1;
+      allocInfo.pSetLayouts = &computeSetLayout;
+      if (vkAllocateDescriptorSets(device, &allocInfo, &slot.descriptorSet) !=
+          VK_SUCCESS) {
+        throw std::runtime_error{"Failed to allocate descriptor set!"};
+      }
+
+      slot.instanceMemory = allocator.create_buffer(
+          bufferSize,
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, slot.instanceBuffer);
+
+      VkDescriptorBufferInfo bufferInfo{};
+      bufferInfo.buffer = slot.instanceBuffer;
+      bufferInfo.offset = 0;
+      bufferInfo.range = bufferSize;
+
+      VkWriteDescriptorSet write{};
+      write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      write.dstSet = slot.descriptorSet;
+      write.dstBinding = 0;
+      write.descriptorCount = 1;
+      write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      write.pBufferInfo = &bufferInfo;
+      vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    }
+  }
+
+  void destroy_animation_buffers() {
+    if (animationSlots.empty()) {
+      return;
+    }
+    for (auto &slot : animationSlots) {
+      allocator.destroy_buffer(slot.instanceBuffer, slot.instanceMemory);
+      slot.instanceBuffer = VK_NULL_HANDLE;
+      slot.descriptorSet = VK_NULL_HANDLE;
+    }
+    vkDestroyDescriptorPool(device, animationDescriptorPool, nullptr);
+    animationDescriptorPool = VK_NULL_HANDLE;
+  }
+  // Swaps in instance buffers for count instances without waiting for the
+  // device. Frames still in flight keep reading the old buffers and
+  // descriptor sets, which go to the deletion queue.
+  void replace_instance_buffer(uint32_t count) {
+    std::vector<CullSlot> retiredCull = cullSlots;
+    std::vector<AnimationSlot> retiredAnimation = animationSlots;
+    VkDescriptorPool retiredPool = animationDescriptorPool;
+    VkBuffer retiredBuffer = instanceBuffer;
+    GpuAllocation retiredMemory = instanceBufferMemory;
+    bool animated = config.gpu_animate;
+    deletions.push(graphicsTimeline->last_submitted(),
+                   [this, retiredCull, retiredAnimation, retiredPool,
+                    retiredBuffer, retiredMemory, animated]() mutable {
+                     for (auto &slot : retiredCull) {
+                       allocator.destroy_buffer(slot.visibleBuffer,
+                                                slot.visibleMemory);
+                       allocator.destroy_buffer(slot.drawBuffer,
+                                                slot.drawMemory);
+                     }
+                     if (!animated) {
+                       allocator.destroy_buffer(retiredBuffer, retiredMemory);
+                       return;
+                     }
+                     for (auto &slot : retiredAnimation) {
+                       allocator.destroy_buffer(slot.instanceBuffer,
+                                                slot.instanceMemory);
+                     }
+                     // Frees the descriptor sets with it.
+                     vkDestroyDescriptorPool(device, retiredPool, nullptr);
+                   });
+    create_instance_buffer(count);
+  }
+
+  void create_animation_slots() {
+    animationSlots.resize(max_frames_in_flight);
+    for (auto &slot : animationSlots) {
+      if (!async_compute) {
+        continue;
+      }
+      VkCommandBufferAllocateInfo commandBufferInfo{};
+      commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      commandBufferInfo.commandPool = computeCommandPool;
+      commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+      commandBufferInfo.commandBufferCount = 1;
+      if (vkAllocateCommandBuffers(device, &commandBufferInfo,
+                                   &slot.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error{"Failed to allocate compute command buffer!"};
+      }
+    }
+    create_animation_buffers();
+  }
+
+  // Sized for instance_count. Before the frame resources exist this
+  // creates nothing, they create the buffers themselves.
+  void create_cull_buffers() {
+    VkDeviceSize visibleSize =
+        sizeof(InstanceData) * instance_count * scene_meshes.size();
+    VkDeviceSize drawSize =
+        sizeof(uint32_t) +
+        2 * sizeof(VkDrawIndexedIndirectCommand) * scene_meshes.size();
+    for (auto &slot : cullSlots) {
+      slot.visibleMemory = allocator.create_buffer(
+          visibleSize,
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, slot.visibleBuffer);
+      slot.drawMemory = allocator.create_buffer(
+          drawSize,
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+              VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, slot.drawBuffer);
+    }
+  }
+
+  void destroy_cull_buffers() {
+    for (auto &slot : cullSlots) {
+      allocator.destroy_buffer(slot.visibleBuffer, slot.visibleMemory);
+      allocator.destroy_buffer(slot.drawBuffer, slot.drawMemory);
+      slot = CullSlot{};
+    }
+  }
+
+  void destroy_animation_slots() {
+    destroy_animation_buffers();
+    for (auto &slot : animationSlots) {
+      if (slot.commandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers(device, computeCommandPool, 1,
+                             &slot.commandBuffer);
+      }
+    }
+    animationSlots.clear();
+  }
+
+  // Deterministic grid of count instances covering the viewport, with
+  // varying rotation and tint.
+  static std::vector<InstanceData> generate_instances(uint32_t count) {
+    std::vector<InstanceData> instances(count);
+    if (count == 1) {
+      instances[0] = {{0.f, 0.f, 1.f, 0.f}, {1.f, 1.f, 1.f}, 0.f};
+      return instances;
+    }
+    uint32_t side =
+        static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+    float cell = 2.f / side;
+    for (uint32_t i = 0; i < count; ++i) {
+      float x = -1.f + (static_cast<float>(i % side) + 0.5f) * cell;
+      float y = -1.f + (static_cast<float>(i / side) + 0.5f) * cell;
+      float rotation = std::fmod(i * 0.37f, 6.2831853f);
+      float hue = std::fmod(i * 0.618034f, 1.f);
+      // Unrelated to the grid order, so overlapping neighbours are drawn
+      // in no particular depth order.
+      float depth = std::fmod(i * 0.754877f, 1.f);
+      instances[i] = {{x, y, cell, rotation},
+                      {0.5f + 0.5f * std::cos(6.2831853f * hue),
+                       0.5f + 0.5f * std::cos(6.2831853f * (hue + 0.333f)),
+                       0.5f + 0.5f * std::cos(6.2831853f * (hue + 0.667f))},
+                      depth};
+    }
+    return instances;
+  }
+
+  void create_frame_resources(uint32_t frames_in_flight) {
+    max_frames_in_flight = frames_in_flight;
+    currentFrame = 0;
+    create_command_buffers();
     create_sync_objects();
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    uniforms.init(device, allocator, frames_in_flight, uniform_ring_frame_size,
+                  properties.limits.minUniformBufferOffsetAlignment);
+    create_uniform_sets();
+    frameDescriptors.init(
+        device, frames_in_flight, frame_descriptor_sets,
+        {{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame_storage_descriptors}});
+    profiler.create_queries(frames_in_flight);
+    if (record_workers) {
+      create_record_slots();
+    }
+    if (config.gpu_animate) {
+      create_animation_slots();
+    }
+    if (config.gpu_cull) {
+      cullSlots.resize(max_frames_in_flight);
+      create_cull_buffers();
+    }
+    if (config.headless) {
+      create_readback_buffers();
+    }
   }
 
-  void drawFrame() {
-    vkWaitForFences(device, 1, &inFlightFence, VK_TRUE, UINT64_MAX);
-    vkResetFences(device, 1, &inFlightFence);
-    uint32_t imageIndex;
-    vkAcquireNextImageKHR(device, swapchain, UINT64_MAX,
-                          imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
-    vkResetCommandBuffer(commandBuffer, 0);
-    recordCommandBuffer(commandBuffer, imageIndex);
+  void create_record_slots() {
+    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physical_device);
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+    recordSlots.resize(max_frames_in_flight);
+    for (auto &slots : recordSlots) {
+      slots.resize(record_workers->size());
+      for (auto &slot : slots) {
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &slot.pool) !=
+            VK_SUCCESS) {
+          throw std::runtime_error{"Failed to create recording command pool!"};
+        }
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = slot.pool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocInfo.commandBufferCount = 1;
+        if (vkAllocateCommandBuffers(device, &allocInfo,
+                                     &slot.commandBuffer) != VK_SUCCESS) {
+          throw std::runtime_error{
+              "Failed to allocate secondary command buffer!"};
+        }
+      }
+    }
+  }
+
+  void destroy_frame_resources() {
+    for (uint32_t i = 0; i < max_frames_in_flight; ++i) {
+      vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+    }
+    vkFreeCommandBuffers(device, commandPool,
+                         static_cast<uint32_t>(commandBuffers.size()),
+                         commandBuffers.data());
+    commandBuffers.clear();
+    imageAvailableSemaphores.clear();
+    frameValues.clear();
+    imageValues.clear();
+    profiler.destroy_queries();
+    // Frees frameUniformSets with it.
+    vkDestroyDescriptorPool(device, uniformDescriptorPool, nullptr);
+    frameUniformSets.clear();
+    uniforms.destroy();
+    frameDescriptors.destroy();
+
+    for (auto &slots : recordSlots) {
+      for (auto &slot : slots) {
+        vkDestroyCommandPool(device, slot.pool, nullptr);
+      }
+    }
+    recordSlots.clear();
+    if (config.gpu_animate) {
+      destroy_animation_slots();
+    }
+    destroy_cull_buffers();
+    cullSlots.clear();
+
+    for (size_t i = 0; i < readbackBuffers.size(); ++i) {
+      allocator.destroy_buffer(readbackBuffers[i], readbackMemory[i]);
+    }
+    readbackBuffers.clear();
+    readbackMemory.clear();
+    readbackFrames.clear();
+  }
 
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  void create_offscreen_targets() {
+    swapchainImageFormat = offscreen_format;
+    swapchainExtent = {window_width, window_height};
+    swapchain_images.resize(config.frames_in_flight);
+    offscreen_image_memory.resize(config.frames_in_flight);
 
-    VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
-    VkPipelineStageFlags waitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+    for (size_t i = 0; i < swapchain_images.size(); ++i) {
+      VkImageCreateInfo imageInfo{};
+      imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+      imageInfo.imageType = VK_IMAGE_TYPE_2D;
+      imageInfo.format = swapchainImageFormat;
+      imageInfo.extent = {swapchainExtent.width, swapchainExtent.height, 1};
+      imageInfo.mipLevels = 1;
+      imageInfo.arrayLayers = 1;
+      imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+      imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+      imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                        VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+      imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+      imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+      offscreen_image_memory[i] = allocator.create_image(
+          imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+          swapchain_images[i]);
+    }
+  }
+
+  // Highest sample count up to config.msaa_samples that both color and
+  // depth attachments support on the device.
+  VkSampleCountFlagBits choose_msaa_samples() const {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    VkSampleCountFlags supported =
+        properties.limits.framebufferColorSampleCounts &
+        properties.limits.framebufferDepthSampleCounts;
+    uint32_t samples =
+        config.msaa_samples == 0 ? VK_SAMPLE_COUNT_64_BIT : config.msaa_samples;
+    while (samples > 1 && !(supported & samples)) {
+      samples /= 2;
+    }
+    if (config.msaa_samples != 1) {
+      std::cout << "MSAA: " << samples << "x" << std::endl;
+    }
+    return static_cast<VkSampleCountFlagBits>(samples);
+  }
+
+  // Without stencil; floating-point depth first, where reverse-Z keeps
+  // precision nearly uniform over the whole range.
+  VkFormat choose_depth_format() const {
+    for (VkFormat format : {VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32,
+                            VK_FORMAT_D16_UNORM}) {
+      VkFormatProperties properties;
+      vkGetPhysicalDeviceFormatProperties(physical_device, format,
+                                          &properties);
+      if (properties.optimalTilingFeatures &
+          VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+        return format;
+      }
+    }
+    throw std::runtime_error{"Failed to find a supported depth format!"};
+  }
 
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = signalSemaphores;
+  // Sized to the swapchain, so recreated with it.
+  void create_render_targets() {
+    if (msaa_samples != VK_SAMPLE_COUNT_1_BIT) {
+      msaaTarget =
+          create_render_target(swapchainImageFormat,
+                               VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                               VK_IMAGE_ASPECT_COLOR_BIT);
+    }
+    depthTarget =
+        create_render_target(depthFormat,
+                             VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                             VK_IMAGE_ASPECT_DEPTH_BIT);
+  }
 
-    if (vkQueueSubmit(graphics_queue, 1, &submitInfo, inFlightFence) !=
+  // A transient attachment with msaa_samples samples.
+  RenderTarget create_render_target(VkFormat format, VkImageUsageFlags usage,
+                                    VkImageAspectFlags aspect) {
+    RenderTarget target;
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent = {swapchainExtent.width, swapchainExtent.height, 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = msaa_samples;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    target.memory = allocator.create_image(
+        imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, target.image);
+
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = target.image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.baseMipLevel = 0;
+    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.baseArrayLayer = 0;
+    viewInfo.subresourceRange.layerCount = 1;
+    if (vkCreateImageView(device, &viewInfo, nullptr, &target.view) !=
         VK_SUCCESS) {
-      throw std::runtime_error{"Failed to submit draw command buffer!"};
+      throw std::runtime_error{"Failed to create render target view!"};
+    }
+    return target;
+  }
+
+  void destroy_render_target(RenderTarget &target) {
+    if (target.image == VK_NULL_HANDLE) {
+      return;
+    }
+    vkDestroyImageView(device, target.view, nullptr);
+    allocator.destroy_image(target.image, target.memory);
+    target = RenderTarget{};
+  }
+
+  void create_readback_buffers() {
+    readback_size = static_cast<VkDeviceSize>(swapchainExtent.width) *
+                    swapchainExtent.height * 4;
+    readbackBuffers.resize(max_frames_in_flight);
+    readbackMemory.resize(max_frames_in_flight);
+    readbackFrames.assign(max_frames_in_flight, std::nullopt);
+    if (!config.dump_dir.empty()) {
+      std::filesystem::create_directories(config.dump_dir);
+    }
+
+    for (uint32_t i = 0; i < max_frames_in_flight; ++i) {
+      // Cached memory makes the CPU-side checksum and dump much faster.
+      readbackMemory[i] = allocator.create_buffer(
+          readback_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+          VK_MEMORY_PROPERTY_HOST_CACHED_BIT, readbackBuffers[i]);
+    }
+  }
+
+  // Consumes the frame waiting in a readback buffer, if any. The caller must
+  // make sure the GPU has finished writing it.
+  void consume_readback(uint32_t slot) {
+    if (!readbackFrames[slot]) {
+      return;
+    }
+    uint64_t frame = *readbackFrames[slot];
+    readbackFrames[slot].reset();
+
+    const auto *pixels =
+        static_cast<const uint8_t *>(readbackMemory[slot].mapped);
+    // FNV-1a, cheap enough to run on every frame.
+    uint64_t checksum = fnv1a64(pixels, readback_size);
+    last_checksum = checksum;
+    ++frames_read_back;
+
+    if (config.print_checksums) {
+      std::cout << "frame " << frame << ": 0x" << std::hex << checksum
+                << std::dec << "\n";
+    }
+    if (!config.dump_dir.empty()) {
+      write_ppm(frame, pixels);
+    }
+  }
+
+  // Consumes readbacks oldest first once the device is idle.
+  void drain_readbacks() {
+    for (uint32_t i = 0; i < readbackFrames.size(); ++i) {
+      consume_readback((currentFrame + i) % readbackFrames.size());
+    }
+  }
+
+  void write_ppm(uint64_t frame, const uint8_t *pixels) {
+    std::stringstream ss;
+    ss << config.dump_dir << "/frame_" << std::setw(6) << std::setfill('0')
+       << frame << ".ppm";
+    std::ofstream file(ss.str(), std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error{"Failed to open " + ss.str()};
+    }
+    file << "P6\n"
+         << swapchainExtent.width << " " << swapchainExtent.height
+         << "\n255\n";
+    size_t pixel_count =
+        static_cast<size_t>(swapchainExtent.width) * swapchainExtent.height;
+    std::vector<char> rgb(pixel_count * 3);
+    for (size_t i = 0; i < pixel_count; ++i) {
+      rgb[i * 3 + 0] = static_cast<char>(pixels[i * 4 + 0]);
+      rgb[i * 3 + 1] = static_cast<char>(pixels[i * 4 + 1]);
+      rgb[i * 3 + 2] = static_cast<char>(pixels[i * 4 + 2]);
+    }
+    file.write(rgb.data(), static_cast<std::streamsize>(rgb.size()));
+  }
+
+  void drawFrame() {
+    ProfileScope frameScope{profiler, "frame", frame_number};
+    {
+      ProfileScope scope{profiler, "wait for frame", frame_number};
+      graphicsTimeline->wait(frameValues[currentFrame]);
+    }
+    deletions.collect(*graphicsTimeline);
+    reload_shaders();
+    profiler.collect(currentFrame);
+    uint32_t imageIndex;
+    bool acquireSuboptimal = false;
+    if (config.headless) {
+      ProfileScope scope{profiler, "readback", frame_number};
+      consume_readback(currentFrame);
+      imageIndex = frame_number % swapchain_images.size();
+    } else {
+      ProfileScope scope{profiler, "acquire", frame_number};
+      VkResult result = vkAcquireNextImageKHR(
+          device, swapchain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
+          VK_NULL_HANDLE, &imageIndex);
+      // Nothing was submitted for this slot, so its timeline value stays
+      // reached and the next call does not block on it.
+      if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+        recreate_swapchain();
+        return;
+      }
+      if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        throw std::runtime_error{"Failed to acquire swapchain image!"};
+      }
+      // The image is still presentable, so draw it and recreate after the
+      // present instead of dropping the frame.
+      acquireSuboptimal = result == VK_SUBOPTIMAL_KHR;
+      for (auto &retired : retiredSwapchains) {
+        deletions.push(graphicsTimeline->last_submitted(), std::move(retired));
+      }
+      retiredSwapchains.clear();
+    }
+
+    // The image may still be rendered by an older frame when the swapchain
+    // hands out images out of order or has fewer images than frames in
+    // flight. Usually that frame is known complete and this does not call
+    // into the driver at all.
+    graphicsTimeline->wait(imageValues[imageIndex]);
+
+    graphicsPipeline = pipelines.get(selected_variant());
+    frameWaits.clear();
+    if (!config.headless) {
+      frameWaits.push_back({imageAvailableSemaphores[currentFrame], 0,
+                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT});
+    }
+    if (config.gpu_animate && async_compute) {
+      submit_animation();
+    }
+    VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+    uint64_t record_start = profiler.now_ns();
+    frameDescriptors.reset(currentFrame);
+    write_frame_uniforms();
+    vkResetCommandBuffer(commandBuffer, 0);
+    recordCommandBuffer(commandBuffer, imageIndex);
+    uint64_t record_end = profiler.now_ns();
+    profiler.record_cpu("record", frame_number, record_start, record_end);
+    frame_stats.add_record((record_end - record_start) / 1e6);
+
+    VkSemaphore renderFinished = config.headless
+                                     ? VK_NULL_HANDLE
+                                     : renderFinishedSemaphores[imageIndex];
+    {
+      ProfileScope scope{profiler, "submit", frame_number};
+      frameValues[currentFrame] = graphicsTimeline->submit(
+          {commandBuffer}, frameWaits, renderFinished);
+    }
+    imageValues[imageIndex] = frameValues[currentFrame];
+    profiler.submitted(currentFrame);
+
+    ++frame_number;
+    if (!startup.finished()) {
+      startup.first_frame();
+      startup.print(std::cout);
+    }
+    if (config.headless) {
+      currentFrame = (currentFrame + 1) % max_frames_in_flight;
+      return;
     }
 
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = signalSemaphores;
+    presentInfo.pWaitSemaphores = &renderFinished;
 
     VkSwapchainKHR swapchains[] = {swapchain};
     presentInfo.swapchainCount = 1;
@@ -177,7 +1457,138 @@ private:
     presentInfo.pImageIndices = &imageIndex;
     presentInfo.pResults = nullptr;
 
-    vkQueuePresentKHR(present_queue, &presentInfo);
+    VkResult result;
+    {
+      ProfileScope scope{profiler, "present", frame_number - 1};
+      result = vkQueuePresentKHR(present_queue, &presentInfo);
+    }
+    currentFrame = (currentFrame + 1) % max_frames_in_flight;
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
+        acquireSuboptimal || framebufferResized) {
+      recreate_swapchain();
+    } else if (result != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to present swapchain image!"};
+    }
+  }
+
+  // Builds a new swapchain from the old one and retires the old objects
+  // without waiting for the device. Frames in flight keep rendering into
+  // and presenting the old images.
+  void recreate_swapchain() {
+    ProfileScope scope{profiler, "recreate swapchain", frame_number};
+    framebufferResized = false;
+    // A minimized window has no drawable area; wait until it comes back.
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    while ((width == 0 || height == 0) && !glfwWindowShouldClose(window)) {
+      glfwWaitEvents();
+      glfwGetFramebufferSize(window, &width, &height);
+    }
+    if (width == 0 || height == 0) {
+      return;
+    }
+
+    // The old objects stay alive until an image of the new swapchain has
+    // been acquired and every frame submitted by then has finished, see
+    // retiredSwapchains. The old swapchain is handed to the new one.
+    VkSwapchainKHR oldSwapchain = swapchain;
+    std::vector<VkImageView> oldImageViews;
+    std::vector<VkFramebuffer> oldFramebuffers;
+    oldImageViews.swap(swapchain_image_views);
+    oldFramebuffers.swap(swapchainFramebuffers);
+    RenderTarget oldMsaaTarget = std::exchange(msaaTarget, RenderTarget{});
+    RenderTarget oldDepthTarget = std::exchange(depthTarget, RenderTarget{});
+    std::vector<VkSemaphore> oldRenderFinished;
+    oldRenderFinished.swap(renderFinishedSemaphores);
+    retiredSwapchains.push_back([this, oldSwapchain, oldImageViews,
+                                 oldFramebuffers, oldMsaaTarget,
+                                 oldDepthTarget,
+                                 oldRenderFinished]() mutable {
+      for (auto framebuffer : oldFramebuffers) {
+        vkDestroyFramebuffer(device, framebuffer, nullptr);
+      }
+      for (auto imageView : oldImageViews) {
+        vkDestroyImageView(device, imageView, nullptr);
+      }
+      destroy_render_target(oldMsaaTarget);
+      destroy_render_target(oldDepthTarget);
+      for (auto semaphore : oldRenderFinished) {
+        vkDestroySemaphore(device, semaphore, nullptr);
+      }
+      vkDestroySwapchainKHR(device, oldSwapchain, nullptr);
+    });
+
+    create_swapchain(oldSwapchain);
+    create_image_views();
+    create_render_targets();
+    create_framebuffers();
+    imageValues.assign(swapchain_images.size(), 0);
+  }
+
+  // Fills this frame's buffer of the uniform ring before recording, so the
+  // recording threads only read viewUniformOffsets. A memcpy per view; the
+  // frame slot's set already points at the buffer.
+  void write_frame_uniforms() {
+    uniforms.begin_frame(currentFrame);
+    viewUniformOffsets.clear();
+    for (uint32_t view = 0; view < config.viewport_count; ++view) {
+      viewUniformOffsets.push_back(uniforms.push(view_uniforms()));
+    }
+
+  }
+
+  // Allocates and writes the set of every frame slot once. The slot's
+  // uniform buffer never changes, so per frame only the dynamic offsets
+  // passed to vkCmdBindDescriptorSets do.
+  void create_uniform_sets() {
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    poolSize.descriptorCount = max_frames_in_flight;
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.maxSets = max_frames_in_flight;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    if (vkCreateDescriptorPool(device, &poolInfo, nullptr,
+                               &uniformDescriptorPool) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor pool!"};
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(max_frames_in_flight,
+                                               uniformSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = uniformDescriptorPool;
+    allocInfo.descriptorSetCount = max_frames_in_flight;
+    allocInfo.pSetLayouts = layouts.data();
+    frameUniformSets.resize(max_frames_in_flight);
+    if (vkAllocateDescriptorSets(device, &allocInfo,
+                                 frameUniformSets.data()) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to allocate descriptor set!"};
+    }
+
+    for (uint32_t frame = 0; frame < max_frames_in_flight; ++frame) {
+      VkDescriptorBufferInfo bufferInfo{};
+      bufferInfo.buffer = uniforms.buffer(frame);
+      bufferInfo.offset = 0;
+      bufferInfo.range = sizeof(ViewUniforms);
+
+      VkWriteDescriptorSet write{};
+      write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      write.dstSet = frameUniformSets[frame];
+      write.dstBinding = 0;
+      write.descriptorCount = 1;
+      write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+      write.pBufferInfo = &bufferInfo;
+      vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    }
+  }
+
+  // Every viewport shows the scene through the same camera.
+  ViewUniforms view_uniforms() const {
+    return {{0.f, 0.f, config.zoom, 0.f}};
   }
 
   void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
@@ -189,6 +1600,7 @@ private:
     if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
       throw std::runtime_error{"Failed to begin recording command buffer!"};
     }
+    profiler.begin_commands(commandBuffer, currentFrame, frame_number);
 
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -197,258 +1609,1021 @@ private:
     renderPassInfo.renderArea.offset = {0, 0};
     renderPassInfo.renderArea.extent = swapchainExtent;
 
-    VkClearValue clearColor = {{{0.f, 0.f, 0.f, 1.f}}};
-    renderPassInfo.clearValueCount = 1;
-    renderPassInfo.pClearValues = &clearColor;
+    // Indexed by attachment; the MSAA resolve target is not cleared.
+    VkClearValue clearValues[3]{};
+    clearValues[0].color = {{0.f, 0.f, 0.f, 1.f}};
+    uint32_t depthAttachment = msaa_samples != VK_SAMPLE_COUNT_1_BIT ? 2 : 1;
+    clearValues[depthAttachment].depthStencil = {0.f, 0};
+    renderPassInfo.clearValueCount = depthAttachment + 1;
+    renderPassInfo.pClearValues = clearValues;
+
+    staging.acquire(commandBuffer, frameWaits);
+    if (config.gpu_animate) {
+      if (async_compute) {
+        acquire_animation(commandBuffer);
+      } else {
+        record_animation(commandBuffer);
+      }
+    }
+    if (config.gpu_cull) {
+      record_cull(commandBuffer);
+    }
 
-    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      graphicsPipeline);
-    vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+    profiler.mark(commandBuffer, currentFrame, GpuMark::RenderPassBegin);
+    if (record_workers) {
+      std::vector<VkCommandBuffer> secondaries =
+          record_secondaries(imageIndex);
+      vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                           VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+      if (!secondaries.empty()) {
+        vkCmdExecuteCommands(commandBuffer,
+                             static_cast<uint32_t>(secondaries.size()),
+                             secondaries.data());
+      }
+    } else {
+      vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                           VK_SUBPASS_CONTENTS_INLINE);
+      if (config.gpu_cull) {
+        record_scene_indirect(commandBuffer);
+      } else {
+        record_scene(commandBuffer, 0, scene_instance_count());
+      }
+    }
     vkCmdEndRenderPass(commandBuffer);
+    profiler.mark(commandBuffer, currentFrame, GpuMark::RenderPassEnd);
+
+    if (config.headless) {
+      record_readback(commandBuffer, imageIndex);
+    }
+    profiler.mark(commandBuffer, currentFrame, GpuMark::FrameEnd);
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
       throw std::runtime_error{"Failed to record command buffer!"};
     }
   }
 
+  // Regenerates the current slot's instances on the GPU. The CPU cost is
+  // the same handful of commands for any instance count. The slot was last
+  // read by the frame whose fence drawFrame waited for, so nothing else
+  // touches the buffer.
+  void record_animation(VkCommandBuffer commandBuffer) {
+    AnimationSlot &slot = animationSlots[currentFrame];
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      computePipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            computePipelineLayout, 0, 1, &slot.descriptorSet,
+                            0, nullptr);
+    // Time derives from the frame number so headless runs stay
+    // reproducible.
+    AnimateParams params{instance_count,
+                         static_cast<float>(frame_number) / 60.f};
+    vkCmdPushConstants(commandBuffer, computePipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params),
+                       &params);
+    vkCmdDispatch(commandBuffer,
+                  (instance_count + animate_group_size - 1) /
+                      animate_group_size,
+                  1, 1);
+
+    // On a compute queue this is the release half of the ownership
+    // transfer to graphics, acquire_animation() records the other half.
+    VkBufferMemoryBarrier barrier = animation_handoff(slot);
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = async_compute ? 0 : animation_reader_access();
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         async_compute ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                                       : animation_reader_stages(),
+                         0, 0, nullptr, 1, &barrier, 0, nullptr);
+  }
+
+  // The graphics side of the transfer, waiting at the same stages as the
+  // semaphore of submit_animation() does.
+  void acquire_animation(VkCommandBuffer commandBuffer) {
+    VkBufferMemoryBarrier barrier =
+        animation_handoff(animationSlots[currentFrame]);
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = animation_reader_access();
+    vkCmdPipelineBarrier(commandBuffer, animation_reader_stages(),
+                         animation_reader_stages(), 0, 0, nullptr, 1, &barrier,
+                         0, nullptr);
+  }
+
+  // The animated instances are drawn directly, or read by the culling
+  // pass which draws copies of them.
+  VkPipelineStageFlags animation_reader_stages() const {
+    return config.gpu_cull ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                           : VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+  }
+  VkAccessFlags animation_reader_access() const {
+    return config.gpu_cull ? VK_ACCESS_SHADER_READ_BIT
+                           : VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+  }
+
+  // Barrier over a slot's instances, moving them from the compute to the
+  // graphics family when those differ. Nothing moves them back: the next
+  // dispatch overwrites the whole buffer, so its old contents may be
+  // discarded.
+  VkBufferMemoryBarrier animation_handoff(const AnimationSlot &slot) {
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    if (async_compute) {
+      barrier.srcQueueFamilyIndex = queueFamilies.computeFamily.value();
+      barrier.dstQueueFamilyIndex = queueFamilies.graphicsFamily.value();
+    }
+    barrier.buffer = slot.instanceBuffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    return barrier;
+  }
+
+  // Records and submits this frame's compute pass on compute_queue. The
+  // graphics submission only waits for it at vertex input, so the pass
+  // overlaps the tail of the previous frame and the start of this one.
+  void submit_animation() {
+    AnimationSlot &slot = animationSlots[currentFrame];
+    vkResetCommandBuffer(slot.commandBuffer, 0);
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to begin compute command buffer!"};
+    }
+    record_animation(slot.commandBuffer);
+    if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to record compute command buffer!"};
+    }
+
+    uint64_t value = computeTimeline->submit({slot.commandBuffer});
+    frameWaits.push_back(
+        computeTimeline->wait_for(value, animation_reader_stages()));
+  }
+
+  // This frame's instances, before culling.
+  VkBuffer frame_instances() const {
+    return config.gpu_animate ? animationSlots[currentFrame].instanceBuffer
+                              : instanceBuffer;
+  }
+
+  void bind_scene(VkCommandBuffer commandBuffer, VkBuffer instances) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      graphicsPipeline);
+    VkBuffer vertexBuffers[] = {vertexBuffer, instances};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+  }
+
+  // Culls this frame's instances into the slot's visible instances and
+  // draws. The CPU records the same few commands for any instance count.
+  void record_cull(VkCommandBuffer commandBuffer) {
+    CullSlot &slot = cullSlots[currentFrame];
+    uint32_t meshCount = static_cast<uint32_t>(scene_meshes.size());
+
+    // A draw count of 0, then every mesh's draw without instances. Mesh m
+    // draws from visible instance m * instance_count on.
+    std::vector<uint32_t> reset(1, 0);
+    for (uint32_t mesh = 0; mesh < meshCount; ++mesh) {
+      const MeshRange &range = scene_meshes[mesh];
+      VkDrawIndexedIndirectCommand draw{};
+      draw.indexCount = range.indexCount;
+      draw.instanceCount = 0;
+      draw.firstIndex = range.firstIndex;
+      draw.vertexOffset = range.vertexOffset;
+      draw.firstInstance = mesh * instance_count;
+      size_t at = reset.size();
+      reset.resize(at + sizeof(draw) / sizeof(uint32_t));
+      std::memcpy(&reset[at], &draw, sizeof(draw));
+    }
+    vkCmdUpdateBuffer(commandBuffer, slot.drawBuffer, 0,
+                      reset.size() * sizeof(uint32_t), reset.data());
+    VkMemoryBarrier resetBarrier{};
+    resetBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    resetBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    resetBarrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &resetBarrier, 0, nullptr, 0, nullptr);
+
+    // The instance source changes per frame with --gpu-animate, so the set
+    // comes from the frame's recycled pools.
+    VkDescriptorSet set =
+        frameDescriptors.allocate(currentFrame, cullSetLayout);
+    VkDescriptorBufferInfo bufferInfos[4] = {
+        {frame_instances(), 0, VK_WHOLE_SIZE},
+        {meshBoundsBuffer, 0, VK_WHOLE_SIZE},
+        {slot.drawBuffer, 0, VK_WHOLE_SIZE},
+        {slot.visibleBuffer, 0, VK_WHOLE_SIZE}};
+    VkWriteDescriptorSet writes[4]{};
+    for (uint32_t binding = 0; binding < 4; ++binding) {
+      writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[binding].dstSet = set;
+      writes[binding].dstBinding = binding;
+      writes[binding].descriptorCount = 1;
+      writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[binding].pBufferInfo = &bufferInfos[binding];
+    }
+    vkUpdateDescriptorSets(device, 4, writes, 0, nullptr);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            cullPipelineLayout, 0, 1, &set, 0, nullptr);
+    CullParams params{};
+    std::memcpy(params.camera, view_uniforms().camera, sizeof(params.camera));
+    params.instanceCount = instance_count;
+    params.meshCount = meshCount;
+    params.pass = 0;
+    vkCmdPushConstants(commandBuffer, cullPipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(commandBuffer,
+                  (instance_count + cull_group_size - 1) / cull_group_size, 1,
+                  1);
+
+    if (draw_indirect_count) {
+      VkMemoryBarrier countBarrier{};
+      countBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      countBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      countBarrier.dstAccessMask =
+          VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                           &countBarrier, 0, nullptr, 0, nullptr);
+      params.pass = 1;
+      vkCmdPushConstants(commandBuffer, cullPipelineLayout,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params),
+                         &params);
+      vkCmdDispatch(commandBuffer,
+                    (meshCount + cull_group_size - 1) / cull_group_size, 1, 1);
+    }
+
+    VkMemoryBarrier drawBarrier{};
+    drawBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    drawBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    drawBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                             VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         0, 1, &drawBarrier, 0, nullptr, 0, nullptr);
+  }
+
+  // Draws what record_cull() left visible, without knowing how much that
+  // is on the CPU.
+  void record_scene_indirect(VkCommandBuffer commandBuffer) {
+    const CullSlot &slot = cullSlots[currentFrame];
+    bind_scene(commandBuffer, slot.visibleBuffer);
+    uint32_t meshCount = static_cast<uint32_t>(scene_meshes.size());
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    // Behind the draw count.
+    const VkDeviceSize meshDraws = sizeof(uint32_t);
+    const VkDeviceSize compactedDraws = meshDraws + meshCount * stride;
+    for (uint32_t view = 0; view < config.viewport_count; ++view) {
+      set_viewport(commandBuffer, view);
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              pipelineLayout, 0, 1,
+                              &frameUniformSets[currentFrame], 1,
+                              &viewUniformOffsets[view]);
+      if (draw_indirect_count) {
+        // Meshes without visible instances are left out entirely.
+        vkCmdDrawIndexedIndirectCount(commandBuffer, slot.drawBuffer,
+                                      compactedDraws, slot.drawBuffer, 0,
+                                      meshCount, stride);
+      } else if (multi_draw_indirect) {
+        vkCmdDrawIndexedIndirect(commandBuffer, slot.drawBuffer, meshDraws,
+                                 meshCount, stride);
+      } else {
+        for (uint32_t mesh = 0; mesh < meshCount; ++mesh) {
+          vkCmdDrawIndexedIndirect(commandBuffer, slot.drawBuffer,
+                                   meshDraws + mesh * stride, 1, stride);
+        }
+      }
+    }
+  }
+
+  // Every instance of every mesh in every view.
+  uint64_t scene_instance_count() const {
+    return uint64_t{config.viewport_count} * scene_meshes.size() *
+           instance_count;
+  }
+
+  // Records instances [first, first + count) of the scene, numbered view by
+  // view, mesh by mesh within a view and instance by instance within a
+  // mesh. The instances of one mesh in one view are one instanced draw, so
+  // the whole scene takes one draw per mesh per view.
+  void record_scene(VkCommandBuffer commandBuffer, uint64_t first,
+                    uint64_t count) {
+    bind_scene(commandBuffer, frame_instances());
+    const uint32_t meshCount = static_cast<uint32_t>(scene_meshes.size());
+    const uint64_t last = first + count;
+    for (uint64_t next = first; next < last;) {
+      uint32_t draw = static_cast<uint32_t>(next / instance_count);
+      uint32_t firstInstance = static_cast<uint32_t>(next % instance_count);
+      uint32_t endInstance = static_cast<uint32_t>(
+          std::min<uint64_t>(instance_count,
+                             last - uint64_t{draw} * instance_count));
+      uint32_t view = draw / meshCount;
+      // Viewport and scissor are dynamic state, so every view and every
+      // swapchain extent is drawn with the same pipeline.
+      if (next == first || draw % meshCount == 0) {
+        set_viewport(commandBuffer, view);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 0, 1,
+                                &frameUniformSets[currentFrame], 1,
+                                &viewUniformOffsets[view]);
+      }
+      const auto &mesh = scene_meshes[draw % meshCount];
+      vkCmdDrawIndexed(commandBuffer, mesh.indexCount,
+                       endInstance - firstInstance, mesh.firstIndex,
+                       mesh.vertexOffset, firstInstance);
+      next = (uint64_t{draw} + 1) * instance_count;
+    }
+  }
+
+  // Sets viewport and scissor to tile view of a near-square grid of
+  // config.viewport_count tiles covering the current extent.
+  void set_viewport(VkCommandBuffer commandBuffer, uint32_t view) {
+    uint32_t columns = static_cast<uint32_t>(
+        std::ceil(std::sqrt(static_cast<double>(config.viewport_count))));
+    uint32_t rows = (config.viewport_count + columns - 1) / columns;
+    uint32_t column = view % columns;
+    uint32_t row = view / columns;
+
+    VkRect2D scissor{};
+    scissor.offset.x =
+        static_cast<int32_t>(swapchainExtent.width * column / columns);
+    scissor.offset.y =
+        static_cast<int32_t>(swapchainExtent.height * row / rows);
+    scissor.extent.width =
+        swapchainExtent.width * (column + 1) / columns - scissor.offset.x;
+    scissor.extent.height =
+        swapchainExtent.height * (row + 1) / rows - scissor.offset.y;
+
+    VkViewport viewport{};
+    viewport.x = (float)scissor.offset.x;
+    viewport.y = (float)scissor.offset.y;
+    viewport.width = (float)scissor.extent.width;
+    viewport.height = (float)scissor.extent.height;
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+  }
+
+  // Splits the scene's instances (see record_scene) into one contiguous
+  // slice per worker and records each slice into that worker's secondary
+  // command buffer for this frame. Slices cut through instanced draws, so
+  // every worker gets a share even when the scene is a single draw, and
+  // the slices draw in the same order as inline recording. Returns the
+  // recorded buffers in slice order; empty slices are skipped.
+  std::vector<VkCommandBuffer> record_secondaries(uint32_t imageIndex) {
+    const uint32_t slice_count = record_workers->size();
+    const uint64_t total = scene_instance_count();
+    std::vector<std::future<void>> pending;
+    std::vector<VkCommandBuffer> secondaries;
+    for (uint32_t slice = 0; slice < slice_count; ++slice) {
+      uint64_t first = total * slice / slice_count;
+      uint64_t last = total * (slice + 1) / slice_count;
+      if (first == last) {
+        continue;
+      }
+      RecordSlot &slot = recordSlots[currentFrame][slice];
+      secondaries.push_back(slot.commandBuffer);
+      pending.push_back(record_workers->submit([this, &slot, imageIndex,
+                                                first, last] {
+        record_slice(slot, imageIndex, first, last - first);
+      }));
+    }
+    // Every worker must be done with its slot before an error leaves this
+    // frame, so wait for all of them first. get() then rethrows the first
+    // recording error on the main thread.
+    for (auto &result : pending) {
+      result.wait();
+    }
+    for (auto &result : pending) {
+      result.get();
+    }
+    return secondaries;
+  }
+
+  // Runs on a worker thread. Only touches slot and read-only state.
+  void record_slice(RecordSlot &slot, uint32_t imageIndex, uint64_t first,
+                    uint64_t count) {
+    vkResetCommandPool(device, slot.pool, 0);
+
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = swapchainFramebuffers[imageIndex];
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                      VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error{
+          "Failed to begin recording secondary command buffer!"};
+    }
+    record_scene(slot.commandBuffer, first, count);
+    if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to record secondary command buffer!"};
+    }
+  }
+
+  // Copies the finished offscreen image into this frame's readback buffer.
+  // The render pass already left the image in TRANSFER_SRC_OPTIMAL.
+  void record_readback(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {swapchainExtent.width, swapchainExtent.height, 1};
+    vkCmdCopyImageToBuffer(commandBuffer, swapchain_images[imageIndex],
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           readbackBuffers[currentFrame], 1, &region);
+
+    VkBufferMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = readbackBuffers[currentFrame];
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                         &barrier, 0, nullptr);
+    readbackFrames[currentFrame] = frame_number;
+  }
+
   void create_sync_objects() {
     VkSemaphoreCreateInfo semaphoreInfo{};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    imageAvailableSemaphores.resize(max_frames_in_flight);
+    // Value 0 is always complete, so unused slots and images never block.
+    frameValues.assign(max_frames_in_flight, 0);
+    imageValues.assign(swapchain_images.size(), 0);
+
+    // Presentation only works with binary semaphores. Everything else
+    // waits on queue timelines.
+    for (uint32_t i = 0; i < max_frames_in_flight; ++i) {
+      if (vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                            &imageAvailableSemaphores[i]) != VK_SUCCESS) {
+        throw std::runtime_error{"Failed to create semaphores!"};
+      }
+    }
+  }
+
+  // One per swapchain image, see renderFinishedSemaphores.
+  void create_render_finished_semaphores() {
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    if (vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                          &imageAvailableSemaphore) != VK_SUCCESS ||
-        vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                          &renderFinishedSemaphore) != VK_SUCCESS ||
-        vkCreateFence(device, &fenceInfo, nullptr, &inFlightFence) !=
-            VK_SUCCESS) {
-      throw std::runtime_error{"Failed to create semaphores!"};
+    renderFinishedSemaphores.resize(swapchain_images.size());
+    for (auto &semaphore : renderFinishedSemaphores) {
+      if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore) !=
+          VK_SUCCESS) {
+        throw std::runtime_error{"Failed to create semaphores!"};
+      }
     }
   }
 
-  void create_command_buffer() {
+  void create_command_buffers() {
+    commandBuffers.resize(max_frames_in_flight);
+
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     allocInfo.commandPool = commandPool;
     allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = 1;
-    if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) !=
+    allocInfo.commandBufferCount = max_frames_in_flight;
+    if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) !=
         VK_SUCCESS) {
       throw std::runtime_error{"Failed to allocate command buffers!"};
     }
   }
 
-  void create_command_pool() {
-    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physical_device);
-    VkCommandPoolCreateInfo poolInfo{};
-    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+  void create_command_pool() {
+    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physical_device);
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+    if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) !=
+        VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create command pool!"};
+    }
+  }
+
+  void create_framebuffers() {
+    swapchainFramebuffers.resize(swapchain_image_views.size());
+
+    for (size_t i = 0; i < swapchain_image_views.size(); ++i) {
+      // Same order as the render pass attachments.
+      std::vector<VkImageView> attachments;
+      if (msaaTarget.view != VK_NULL_HANDLE) {
+        attachments.push_back(msaaTarget.view);
+      }
+      attachments.push_back(swapchain_image_views[i]);
+      attachments.push_back(depthTarget.view);
+
+      VkFramebufferCreateInfo framebufferInfo{};
+      framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      framebufferInfo.renderPass = renderPass;
+      framebufferInfo.attachmentCount =
+          static_cast<uint32_t>(attachments.size());
+      framebufferInfo.pAttachments = attachments.data();
+      framebufferInfo.width = swapchainExtent.width;
+      framebufferInfo.height = swapchainExtent.height;
+      framebufferInfo.layers = 1;
+
+      if (vkCreateFramebuffer(device, &framebufferInfo, nullptr,
+                              &swapchainFramebuffers[i]) != VK_SUCCESS) {
+        throw std::runtime_error{"Failed to create framebuffer!"};
+      }
+    }
+  }
+
+  // Created before the pipelines, which only read it, since the frame
+  // resources allocate their uniform sets from it while the graphics
+  // pipeline still compiles.
+  void create_uniform_set_layout() {
+    VkDescriptorSetLayoutBinding uniformBinding{};
+    uniformBinding.binding = 0;
+    uniformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    uniformBinding.descriptorCount = 1;
+    uniformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo{};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = 1;
+    setLayoutInfo.pBindings = &uniformBinding;
+    if (vkCreateDescriptorSetLayout(device, &setLayoutInfo, nullptr,
+                                    &uniformSetLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor set layout!"};
+    }
+  }
+
+  void create_graphic_pipeline() {
+    PipelineShared shared;
+    shared.vertex_shader = createShaderModule(
+        shaders::shader_vert_spv, sizeof(shaders::shader_vert_spv));
+    shared.fragment_shader = createShaderModule(
+        shaders::shader_frag_spv, sizeof(shaders::shader_frag_spv));
+    shared.bindings = {Vertex::getBindingDescription(),
+                       InstanceData::getBindingDescription()};
+    shared.attributes = Vertex::getAttributeDescriptions();
+    auto instanceAttributeDescriptions =
+        InstanceData::getAttributeDescriptions();
+    shared.attributes.insert(shared.attributes.end(),
+                             instanceAttributeDescriptions.begin(),
+                             instanceAttributeDescriptions.end());
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &uniformSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 0;
+    pipelineLayoutInfo.pPushConstantRanges = nullptr;
+
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+                               &pipelineLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create pipeline layout!"};
+    }
+    shared.layout = pipelineLayout;
+
+    if (config.pipeline_variant.polygon_mode != VK_POLYGON_MODE_FILL &&
+        !fill_mode_non_solid) {
+      throw std::runtime_error{"Line and point pipelines are not supported!"};
+    }
+    // hardware_concurrency() may return 0 when unknown.
+    uint32_t compile_threads =
+        std::max(2u, std::thread::hardware_concurrency()) - 1;
+    compile_workers = std::make_unique<ThreadPool>(compile_threads);
+    pipelines.init(device, pipelineCache, *compile_workers, std::move(shared));
+    pipelines.set_render_pass(msaa_samples, renderPass);
+
+    // Only the default variant is compiled before the first frame; it is
+    // what every other variant falls back to while it compiles.
+    PipelineKey fallback;
+    fallback.samples = msaa_samples;
+    report_pipeline_creation_time(pipelines.compile_fallback(fallback));
+    request_pipeline_variants();
+
+    if (config.watch_shaders) {
+      shader_watcher = std::make_unique<ShaderWatcher>(
+          SHADERS_SOURCE_DIR, GLSLC_EXECUTABLE,
+          ShaderWatcher::Bundle{
+              {"shader.vert",
+               {std::begin(shaders::shader_vert_spv),
+                std::end(shaders::shader_vert_spv)}},
+              {"shader.frag",
+               {std::begin(shaders::shader_frag_spv),
+                std::end(shaders::shader_frag_spv)}}});
+    }
+  }
+
+  // Hands freshly compiled shaders to the pipeline registry and switches to
+  // the new pipelines once they are ready. The render thread never waits on
+  // glslc or the pipeline compiler; it keeps drawing with the old pipelines
+  // in the meantime, and for good if the new ones fail to build.
+  void reload_shaders() {
+    if (!shader_watcher) {
+      return;
+    }
+    if (auto bundle = shader_watcher->take_update()) {
+      const auto &vert = bundle->at("shader.vert");
+      const auto &frag = bundle->at("shader.frag");
+      VkShaderModule vertModule = VK_NULL_HANDLE;
+      VkShaderModule fragModule = VK_NULL_HANDLE;
+      try {
+        vertModule =
+            createShaderModule(vert.data(), vert.size() * sizeof(uint32_t));
+        fragModule =
+            createShaderModule(frag.data(), frag.size() * sizeof(uint32_t));
+      } catch (const std::exception &e) {
+        // Destroying VK_NULL_HANDLE is a no-op.
+        vkDestroyShaderModule(device, vertModule, nullptr);
+        vkDestroyShaderModule(device, fragModule, nullptr);
+        vertModule = VK_NULL_HANDLE;
+        std::cerr << "Reloaded shaders: " << e.what()
+                  << ", keeping the old ones" << std::endl;
+      }
+      if (vertModule != VK_NULL_HANDLE) {
+        // Takes ownership of both.
+        pipelines.reload(vertModule, fragModule);
+      }
+    }
+    uint64_t last_use = graphicsTimeline->last_submitted();
+    if (pipelines.swap_if_ready(deletions, last_use)) {
+      std::cout << "Shaders reloaded" << std::endl;
+    }
+  }
+
+  void create_compute_pipeline() {
+    if (!queueFamilies.computeFamily.has_value()) {
+      throw std::runtime_error{"No queue family supports compute!"};
+    }
 
-    if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) !=
-        VK_SUCCESS) {
-      throw std::runtime_error{"Failed to create command pool!"};
+    VkDescriptorSetLayoutBinding binding{};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    binding.descriptorCount = 1;
+    binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &binding;
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr,
+                                    &computeSetLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor set layout!"};
     }
-  }
 
-  void create_framebuffers() {
-    swapchainFramebuffers.resize(swapchain_image_views.size());
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(AnimateParams);
 
-    for (size_t i = 0; i < swapchain_image_views.size(); ++i) {
-      VkImageView attachments[] = {swapchain_image_views[i]};
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &computeSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+                               &computePipelineLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create compute pipeline layout!"};
+    }
 
-      VkFramebufferCreateInfo framebufferInfo{};
-      framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-      framebufferInfo.renderPass = renderPass;
-      framebufferInfo.attachmentCount = 1;
-      framebufferInfo.pAttachments = attachments;
-      framebufferInfo.width = swapchainExtent.width;
-      framebufferInfo.height = swapchainExtent.height;
-      framebufferInfo.layers = 1;
+    VkShaderModule computeShader = createShaderModule(
+        shaders::animate_comp_spv, sizeof(shaders::animate_comp_spv));
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = computeShader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = computePipelineLayout;
+    VkResult result = vkCreateComputePipelines(
+        device, pipelineCache, 1, &pipelineInfo, nullptr, &computePipeline);
+    vkDestroyShaderModule(device, computeShader, nullptr);
+    if (result != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create compute pipeline!"};
+    }
 
-      if (vkCreateFramebuffer(device, &framebufferInfo, nullptr,
-                              &swapchainFramebuffers[i]) != VK_SUCCESS) {
-        throw std::runtime_error{"Failed to create framebuffer!"};
+    if (async_compute) {
+      VkCommandPoolCreateInfo poolInfo{};
+      poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+      poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+      poolInfo.queueFamilyIndex = queueFamilies.computeFamily.value();
+      if (vkCreateCommandPool(device, &poolInfo, nullptr,
+                              &computeCommandPool) != VK_SUCCESS) {
+        throw std::runtime_error{"Failed to create compute command pool!"};
       }
     }
   }
 
-  void create_graphic_pipeline() {
-    auto vertShaderCode = readFile(SHADERS_BINS, "vert.spv");
-    auto fragShaderCode = readFile(SHADERS_BINS, "frag.spv");
+  // Runs on the graphics queue, right before the render pass that draws
+  // its output.
+  void create_cull_pipeline() {
+    std::vector<VkQueueFamilyProperties> families =
+        queue_family_properties(physical_device);
+    if (!(families[queueFamilies.graphicsFamily.value()].queueFlags &
+          VK_QUEUE_COMPUTE_BIT)) {
+      throw std::runtime_error{"The graphics queue does not support compute!"};
+    }
 
-    VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-    VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+    std::vector<VkDescriptorSetLayoutBinding> bindings(4);
+    for (uint32_t binding = 0; binding < bindings.size(); ++binding) {
+      bindings[binding].binding = binding;
+      bindings[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      bindings[binding].descriptorCount = 1;
+      bindings[binding].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr,
+                                    &cullSetLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create descriptor set layout!"};
+    }
 
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-    vertShaderStageInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertShaderModule;
-    vertShaderStageInfo.pName = "main";
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(CullParams);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &cullSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
+                               &cullPipelineLayout) != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create cull pipeline layout!"};
+    }
 
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-    fragShaderStageInfo.sType =
+    VkShaderModule cullShader = createShaderModule(
+        shaders::cull_comp_spv, sizeof(shaders::cull_comp_spv));
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType =
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShaderModule;
-    fragShaderStageInfo.pName = "main";
-
-    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
-                                                      fragShaderStageInfo};
-
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-    vertexInputInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 0;
-    vertexInputInfo.pVertexBindingDescriptions = nullptr;
-    vertexInputInfo.vertexAttributeDescriptionCount = 0;
-    vertexInputInfo.pVertexAttributeDescriptions = nullptr;
-
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-    inputAssembly.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = cullShader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = cullPipelineLayout;
+    VkResult result = vkCreateComputePipelines(
+        device, pipelineCache, 1, &pipelineInfo, nullptr, &cullPipeline);
+    vkDestroyShaderModule(device, cullShader, nullptr);
+    if (result != VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create cull pipeline!"};
+    }
+  }
 
-    VkViewport viewport{};
-    viewport.x = 0.f;
-    viewport.y = 0.f;
-    viewport.width = (float)swapchainExtent.width;
-    viewport.height = (float)swapchainExtent.height;
-    viewport.minDepth = 0.f;
-    viewport.maxDepth = 1.f;
+  void destroy_cull_pipeline() {
+    vkDestroyPipeline(device, cullPipeline, nullptr);
+    vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, cullSetLayout, nullptr);
+  }
 
-    VkRect2D scissor{};
-    scissor.offset = {0, 0};
-    scissor.extent = swapchainExtent;
-
-    VkPipelineViewportStateCreateInfo viewportState{};
-    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
-    viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
-
-    VkPipelineRasterizationStateCreateInfo rasterizer{};
-    rasterizer.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth = 1.f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-    rasterizer.depthBiasConstantFactor = 0.f;
-    rasterizer.depthBiasClamp = 0.f;
-    rasterizer.depthBiasSlopeFactor = 0.f;
-
-    VkPipelineMultisampleStateCreateInfo multisampling{};
-    multisampling.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling.minSampleShading = 1.f;
-    multisampling.pSampleMask = nullptr;
-    multisampling.alphaToCoverageEnable = VK_FALSE;
-    multisampling.alphaToOneEnable = VK_FALSE;
-
-    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-        VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-
-    /* Alfa blend
-    colorBlendAttachment.blendEnable = VK_TRUE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-    colorBlendAttachment.dstColorBlendFactor =
-        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-    */
-
-    VkPipelineColorBlendStateCreateInfo colorBlending{};
-    colorBlending.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.f;
-    colorBlending.blendConstants[1] = 0.f;
-    colorBlending.blendConstants[2] = 0.f;
-    colorBlending.blendConstants[3] = 0.f;
-
-    std::vector<VkDynamicState> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT,
-                                                 VK_DYNAMIC_STATE_LINE_WIDTH};
-    VkPipelineDynamicStateCreateInfo dynamicState{};
-    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamicState.dynamicStateCount =
-        static_cast<uint32_t>(dynamicStates.size());
-    dynamicState.pDynamicStates = dynamicStates.data();
+  void destroy_compute_pipeline() {
+    if (computeCommandPool != VK_NULL_HANDLE) {
+      vkDestroyCommandPool(device, computeCommandPool, nullptr);
+    }
+    vkDestroyPipeline(device, computePipeline, nullptr);
+    vkDestroyPipelineLayout(device, computePipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, computeSetLayout, nullptr);
+  }
 
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0;
-    pipelineLayoutInfo.pSetLayouts = nullptr;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-    pipelineLayoutInfo.pPushConstantRanges = nullptr;
+  // Queues every supported combination of the variant state for background
+  // compilation, so switching between variants never hits the compiler.
+  void request_pipeline_variants() {
+    std::vector<VkPolygonMode> polygonModes = {VK_POLYGON_MODE_FILL};
+    if (fill_mode_non_solid) {
+      polygonModes.push_back(VK_POLYGON_MODE_LINE);
+      polygonModes.push_back(VK_POLYGON_MODE_POINT);
+    }
+    // The requested variant goes first.
+    pipelines.request(selected_variant());
+    for (VkSampleCountFlagBits samples :
+         {VK_SAMPLE_COUNT_1_BIT, VK_SAMPLE_COUNT_2_BIT, VK_SAMPLE_COUNT_4_BIT,
+          VK_SAMPLE_COUNT_8_BIT}) {
+      if (!pipelines.has_render_pass(samples)) {
+        continue;
+      }
+      for (bool blend : {false, true}) {
+        for (VkPolygonMode polygonMode : polygonModes) {
+          for (VkCullModeFlags cullMode :
+               {VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_NONE,
+                VK_CULL_MODE_FRONT_BIT}) {
+            PipelineKey key;
+            key.blend = blend;
+            key.polygon_mode = polygonMode;
+            key.cull_mode = cullMode;
+            key.samples = samples;
+            pipelines.request(key);
+          }
+        }
+      }
+    }
+  }
 
-    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr,
-                               &pipelineLayout) != VK_SUCCESS) {
-      throw std::runtime_error{"Failed to create pipeline layout!"};
+  // config.pipeline_variant at the sample count of the render pass.
+  PipelineKey selected_variant() const {
+    PipelineKey key = config.pipeline_variant;
+    key.samples = msaa_samples;
+    return key;
+  }
+
+  void report_pipeline_creation_time(uint64_t create_us) {
+    // Runs in the background graphics pipeline stage.
+    std::ostream &out = StartupScheduler::out();
+    out << std::fixed << std::setprecision(3)
+        << "Graphics pipeline created in " << create_us / 1000.0
+        << " ms (" << (pipeline_cache_warm ? "warm" : "cold")
+        << " pipeline cache";
+    if (!pipeline_cache_warm) {
+      cold_pipeline_create_us = create_us;
+    } else if (cold_pipeline_create_us != 0) {
+      out << ", cold start took " << cold_pipeline_create_us / 1000.0
+          << " ms, saved "
+          << (static_cast<double>(cold_pipeline_create_us) -
+              static_cast<double>(create_us)) /
+                 1000.0
+          << " ms";
     }
+    out << ")" << std::endl;
+  }
 
-    VkGraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
+  void create_pipeline_cache() {
+    std::vector<char> initialData = load_pipeline_cache_data();
+    pipeline_cache_warm = !initialData.empty();
 
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pViewportState = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pDepthStencilState = nullptr;
-    pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr;
+    VkPipelineCacheCreateInfo cacheInfo{};
+    cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    cacheInfo.initialDataSize = initialData.size();
+    cacheInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+    if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) !=
+        VK_SUCCESS) {
+      // The driver can still refuse data we validated, start empty instead.
+      cacheInfo.initialDataSize = 0;
+      cacheInfo.pInitialData = nullptr;
+      pipeline_cache_warm = false;
+      if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) !=
+          VK_SUCCESS) {
+        throw std::runtime_error{"Failed to create pipeline cache!"};
+      }
+    }
+  }
 
-    pipelineInfo.layout = pipelineLayout;
+  PipelineCacheFileHeader make_pipeline_cache_header() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+    PipelineCacheFileHeader header{};
+    header.magic = PipelineCacheFileHeader::magic_value;
+    header.version = PipelineCacheFileHeader::current_version;
+    header.vendor_id = properties.vendorID;
+    header.device_id = properties.deviceID;
+    header.driver_version = properties.driverVersion;
+    std::memcpy(header.pipeline_cache_uuid, properties.pipelineCacheUUID,
+                VK_UUID_SIZE);
+    return header;
+  }
 
-    pipelineInfo.renderPass = renderPass;
-    pipelineInfo.subpass = 0;
+  // Returns the cached blob, or nothing when the file is missing, stale or
+  // corrupt.
+  std::vector<char> load_pipeline_cache_data() {
+    // Runs in the background pipeline cache stage.
+    std::ostream &err = StartupScheduler::err();
+    if (config.pipeline_cache_file.empty()) {
+      return {};
+    }
+    std::ifstream file(config.pipeline_cache_file,
+                       std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+      return {};
+    }
+    size_t fileSize = static_cast<size_t>(file.tellg());
+    PipelineCacheFileHeader header{};
+    if (fileSize < sizeof(header)) {
+      err << "Ignoring truncated pipeline cache" << std::endl;
+      return {};
+    }
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+    PipelineCacheFileHeader expected = make_pipeline_cache_header();
+    if (header.magic != expected.magic || header.version != expected.version ||
+        header.vendor_id != expected.vendor_id ||
+        header.device_id != expected.device_id ||
+        header.driver_version != expected.driver_version ||
+        std::memcmp(header.pipeline_cache_uuid, expected.pipeline_cache_uuid,
+                    VK_UUID_SIZE) != 0) {
+      err << "Ignoring pipeline cache built for another device or driver"
+          << std::endl;
+      return {};
+    }
+    if (header.data_size != fileSize - sizeof(header)) {
+      err << "Ignoring truncated pipeline cache" << std::endl;
+      return {};
+    }
 
-    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
-    pipelineInfo.basePipelineIndex = -1;
+    std::vector<char> data(header.data_size);
+    file.read(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!file || fnv1a64(data.data(), data.size()) != header.data_checksum ||
+        !is_pipeline_cache_blob_valid(data, expected)) {
+      err << "Ignoring corrupt pipeline cache" << std::endl;
+      return {};
+    }
+    cold_pipeline_create_us = header.cold_create_us;
+    return data;
+  }
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
-                                  nullptr, &graphicsPipeline) != VK_SUCCESS) {
-      throw std::runtime_error{"Failed to create graphics pipeline!"};
+  // Checks the header the driver puts in front of its own data, so we never
+  // pass a blob the driver would misinterpret.
+  static bool is_pipeline_cache_blob_valid(
+      const std::vector<char> &data, const PipelineCacheFileHeader &expected) {
+    // headerSize, headerVersion, vendorID, deviceID, pipelineCacheUUID.
+    constexpr size_t blob_header_size = 16 + VK_UUID_SIZE;
+    if (data.size() < blob_header_size) {
+      return false;
     }
+    uint32_t fields[4];
+    std::memcpy(fields, data.data(), sizeof(fields));
+    return fields[0] >= blob_header_size &&
+           fields[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           fields[2] == expected.vendor_id && fields[3] == expected.device_id &&
+           std::memcmp(data.data() + 16, expected.pipeline_cache_uuid,
+                       VK_UUID_SIZE) == 0;
+  }
 
-    vkDestroyShaderModule(device, vertShaderModule, nullptr);
-    vkDestroyShaderModule(device, fragShaderModule, nullptr);
+  void save_pipeline_cache() {
+    if (config.pipeline_cache_file.empty()) {
+      return;
+    }
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) !=
+            VK_SUCCESS ||
+        dataSize == 0) {
+      return;
+    }
+    std::vector<char> data(dataSize);
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize,
+                               data.data()) != VK_SUCCESS) {
+      std::cerr << "Failed to read pipeline cache data" << std::endl;
+      return;
+    }
+    data.resize(dataSize);
+
+    PipelineCacheFileHeader header = make_pipeline_cache_header();
+    header.data_size = data.size();
+    header.data_checksum = fnv1a64(data.data(), data.size());
+    header.cold_create_us = cold_pipeline_create_us;
+
+    // Write next to the target and rename, so a crash never leaves a
+    // half-written cache behind.
+    std::string tmp_path = config.pipeline_cache_file + ".tmp";
+    {
+      std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        std::cerr << "Failed to write pipeline cache " << tmp_path
+                  << std::endl;
+        return;
+      }
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, config.pipeline_cache_file, ec);
+    if (ec) {
+      std::cerr << "Failed to save pipeline cache: " << ec.message()
+                << std::endl;
+    }
   }
 
-  VkShaderModule createShaderModule(const std::vector<char> &code) {
+  VkShaderModule createShaderModule(const uint32_t *code, size_t size) {
     VkShaderModuleCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = code.size();
-    createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+    createInfo.codeSize = size;
+    createInfo.pCode = code;
 
     VkShaderModule shaderModule;
     if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) !=
@@ -459,15 +2634,21 @@ private:
   }
 
   void create_render_pass() {
+    bool multisampled = msaa_samples != VK_SAMPLE_COUNT_1_BIT;
+    std::vector<VkAttachmentDescription> attachments;
+
     VkAttachmentDescription colorAttachment{};
     colorAttachment.format = swapchainImageFormat;
-    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.samples = msaa_samples;
     colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = config.headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    attachments.push_back(colorAttachment);
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -478,22 +2659,87 @@ private:
     subpass.colorAttachmentCount = 1;
     subpass.pColorAttachments = &colorAttachmentRef;
 
-    VkSubpassDependency dependency{};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkAttachmentReference resolveAttachmentRef{};
+    if (multisampled) {
+      // The samples are only needed until they are resolved into the
+      // single-sampled image, which takes over the final layout.
+      VkAttachmentDescription resolveAttachment = colorAttachment;
+      resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+      resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      attachments.push_back(resolveAttachment);
+
+      resolveAttachmentRef.attachment = 1;
+      resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+      subpass.pResolveAttachments = &resolveAttachmentRef;
+    }
+
+    // Depth is only needed while drawing, so it is cleared and never
+    // stored, which lets tiled GPUs skip the memory traffic entirely.
+    VkAttachmentDescription depthAttachment{};
+    depthAttachment.format = depthFormat;
+    depthAttachment.samples = msaa_samples;
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depthAttachment.finalLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments.push_back(depthAttachment);
+
+    VkAttachmentReference depthAttachmentRef{};
+    depthAttachmentRef.attachment =
+        static_cast<uint32_t>(attachments.size() - 1);
+    depthAttachmentRef.layout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+    VkSubpassDependency dependencies[2]{};
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    // Every frame in flight clears the same depth and multisampled images,
+    // so the previous frame's writes to them must be finished first.
+    dependencies[0].srcAccessMask =
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+        (multisampled ? VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT : 0);
+    dependencies[0].dstStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependencies[0].dstAccessMask =
+        VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    if (config.headless) {
+      // Offscreen images are reused without an acquire semaphore, so wait
+      // for the previous readback copy before clearing the image again and
+      // make the rendered pixels visible to this frame's copy.
+      dependencies[0].srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+      dependencies[1].srcSubpass = 0;
+      dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+      dependencies[1].srcStageMask =
+          VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+      dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    }
 
     VkRenderPassCreateInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    renderPassInfo.attachmentCount = 1;
-    renderPassInfo.pAttachments = &colorAttachment;
+    renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+    renderPassInfo.pAttachments = attachments.data();
     renderPassInfo.subpassCount = 1;
     renderPassInfo.pSubpasses = &subpass;
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    renderPassInfo.dependencyCount = config.headless ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies;
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) !=
         VK_SUCCESS) {
@@ -527,7 +2773,7 @@ private:
     }
   }
 
-  void create_swapchain() {
+  void create_swapchain(VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE) {
     SwapchainSupportDetails swapchainSupport =
         querySwapchainSupport(physical_device);
     VkSurfaceFormatKHR surfaceFormat =
@@ -536,11 +2782,8 @@ private:
         chooseSwapPresentMode(swapchainSupport.presentModes);
     VkExtent2D extent = chooseSwapExtent(swapchainSupport.capabilities);
 
-    uint32_t imageCount = swapchainSupport.capabilities.minImageCount + 1;
-    if (swapchainSupport.capabilities.maxImageCount > 0 &&
-        imageCount > swapchainSupport.capabilities.maxImageCount) {
-      imageCount = swapchainSupport.capabilities.maxImageCount;
-    }
+    uint32_t imageCount =
+        chooseSwapImageCount(presentMode, swapchainSupport.capabilities);
     VkSwapchainCreateInfoKHR createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
     createInfo.surface = surface;
@@ -568,7 +2811,9 @@ private:
 
     createInfo.presentMode = presentMode;
     createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    // Lets the driver reuse the old swapchain's resources. The old handle
+    // stays valid for frames still presenting from it.
+    createInfo.oldSwapchain = oldSwapchain;
 
     if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapchain) !=
         VK_SUCCESS) {
@@ -580,6 +2825,8 @@ private:
                             swapchain_images.data());
     swapchainImageFormat = surfaceFormat.format;
     swapchainExtent = extent;
+    swapchainPresentMode = presentMode;
+    create_render_finished_semaphores();
   }
 
   VkSurfaceFormatKHR chooseSwapSurfaceFormat(
@@ -595,14 +2842,85 @@ private:
 
   VkPresentModeKHR chooseSwapPresentMode(
       const std::vector<VkPresentModeKHR> &available_present_modes) {
-    for (const auto &available_present_mode : available_present_modes) {
-      if (available_present_mode == VK_PRESENT_MODE_MAILBOX_KHR) {
-        return available_present_mode;
+    std::vector<VkPresentModeKHR> preferred;
+    switch (config.present_policy) {
+    case PresentPolicy::Mailbox:
+      preferred = {VK_PRESENT_MODE_MAILBOX_KHR};
+      break;
+    case PresentPolicy::LowLatency:
+      preferred = {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR};
+      break;
+    case PresentPolicy::PowerSaving:
+      break;
+    case PresentPolicy::FifoRelaxed:
+      preferred = {VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+      break;
+    }
+    for (auto mode : preferred) {
+      if (std::find(available_present_modes.begin(),
+                    available_present_modes.end(),
+                    mode) != available_present_modes.end()) {
+        return mode;
       }
     }
+    // FIFO is the only mode every implementation has to support.
     return VK_PRESENT_MODE_FIFO_KHR;
   }
 
+  uint32_t chooseSwapImageCount(VkPresentModeKHR presentMode,
+                                const VkSurfaceCapabilitiesKHR &capabilities) {
+    // MAILBOX needs three images to replace a queued frame while another
+    // one is on screen and a third is rendered.
+    const uint32_t mailboxCount = std::max(capabilities.minImageCount, 3u);
+    uint32_t imageCount = capabilities.minImageCount;
+    switch (config.present_policy) {
+    case PresentPolicy::Mailbox:
+      // Without MAILBOX this fell back to FIFO, where one spare image keeps
+      // acquire from waiting on the display.
+      imageCount = presentMode == VK_PRESENT_MODE_MAILBOX_KHR
+                       ? mailboxCount
+                       : capabilities.minImageCount + 1;
+      break;
+    case PresentPolicy::LowLatency:
+      // IMMEDIATE never waits for an image to be released, so the minimum
+      // is enough.
+      imageCount = presentMode == VK_PRESENT_MODE_MAILBOX_KHR
+                       ? mailboxCount
+                       : capabilities.minImageCount;
+      break;
+    case PresentPolicy::PowerSaving:
+      // One image on screen and one being rendered; acquire blocks until
+      // the display releases one, which is what idles the CPU and GPU.
+      imageCount = std::max(capabilities.minImageCount, 2u);
+      break;
+    case PresentPolicy::FifoRelaxed:
+      // A spare image, so a frame that missed vblank can be queued and
+      // shown immediately while the next one is rendered.
+      imageCount = std::max(capabilities.minImageCount, 2u) + 1;
+      break;
+    }
+    if (capabilities.maxImageCount > 0 &&
+        imageCount > capabilities.maxImageCount) {
+      imageCount = capabilities.maxImageCount;
+    }
+    return imageCount;
+  }
+
+  static const char *present_mode_name(VkPresentModeKHR mode) {
+    switch (mode) {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+      return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+      return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR:
+      return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+      return "FIFO_RELAXED";
+    default:
+      return "unknown";
+    }
+  }
+
   VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR &capabilities) {
     if (capabilities.currentExtent.width !=
         std::numeric_limits<uint32_t>::max()) {
@@ -652,7 +2970,13 @@ private:
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
     std::set<uint32_t> uniqueQueueFamilies = {indices.graphicsFamily.value(),
-                                              indices.presentFamily.value()};
+                                              indices.transferFamily.value()};
+    if (indices.presentFamily) {
+      uniqueQueueFamilies.insert(indices.presentFamily.value());
+    }
+    if (indices.computeFamily) {
+      uniqueQueueFamilies.insert(indices.computeFamily.value());
+    }
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -664,18 +2988,46 @@ private:
       queueCreateInfos.push_back(queueCreateInfo);
     }
 
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physical_device, &supportedFeatures);
     VkPhysicalDeviceFeatures deviceFeatures{};
+    // Needed by the wireframe and point pipeline variants.
+    deviceFeatures.fillModeNonSolid = supportedFeatures.fillModeNonSolid;
+    fill_mode_non_solid = supportedFeatures.fillModeNonSolid == VK_TRUE;
+    // Used by --gpu-cull when available.
+    deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+    multi_draw_indirect = supportedFeatures.multiDrawIndirect == VK_TRUE;
+    // Required by --gpu-cull, see supports_required_features.
+    deviceFeatures.drawIndirectFirstInstance =
+        supportedFeatures.drawIndirectFirstInstance;
+
+    VkPhysicalDeviceVulkan12Features supported12{};
+    supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 supported{};
+    supported.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported.pNext = &supported12;
+    vkGetPhysicalDeviceFeatures2(physical_device, &supported);
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12Features.timelineSemaphore = VK_TRUE;
+    // A draw count above 1 also needs multiDrawIndirect.
+    vulkan12Features.drawIndirectCount =
+        multi_draw_indirect ? supported12.drawIndirectCount : VK_FALSE;
+    draw_indirect_count = vulkan12Features.drawIndirectCount == VK_TRUE;
+
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pNext = &vulkan12Features;
 
     createInfo.queueCreateInfoCount =
         static_cast<uint32_t>(queueCreateInfos.size());
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount =
-        static_cast<uint32_t>(device_extensions.size());
-    createInfo.ppEnabledExtensionNames = device_extensions.data();
+    auto extensions = get_required_device_extensions();
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     if (enableValidationLayers) {
       createInfo.enabledLayerCount =
@@ -691,36 +3043,104 @@ private:
     }
     vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0,
                      &graphics_queue);
-    vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &present_queue);
+    if (indices.presentFamily) {
+      vkGetDeviceQueue(device, indices.presentFamily.value(), 0,
+                       &present_queue);
+    }
+    compute_queue = graphics_queue;
+    if (indices.computeFamily) {
+      vkGetDeviceQueue(device, indices.computeFamily.value(), 0,
+                       &compute_queue);
+      async_compute = indices.computeFamily != indices.graphicsFamily;
+    }
+    vkGetDeviceQueue(device, indices.transferFamily.value(), 0,
+                     &transfer_queue);
+    queueFamilies = indices;
+    graphicsTimeline = timeline_for(graphics_queue, *indices.graphicsFamily);
+    computeTimeline = timeline_for(
+        compute_queue, indices.computeFamily.value_or(*indices.graphicsFamily));
+    transferTimeline = timeline_for(transfer_queue, *indices.transferFamily);
+    std::cout << "Queue families: graphics " << *indices.graphicsFamily
+              << ", compute "
+              << (indices.computeFamily ? std::to_string(*indices.computeFamily)
+                                        : "none")
+              << ", transfer " << *indices.transferFamily << std::endl;
+  }
+
+  QueueTimeline *timeline_for(VkQueue queue, uint32_t family) {
+    for (auto &timeline : queueTimelines) {
+      if (timeline->queue() == queue) {
+        return timeline.get();
+      }
+    }
+    queueTimelines.push_back(std::make_unique<QueueTimeline>());
+    queueTimelines.back()->init(device, queue, family);
+    return queueTimelines.back().get();
+  }
+
+  static std::vector<VkQueueFamilyProperties>
+  queue_family_properties(VkPhysicalDevice device) {
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &count, families.data());
+    return families;
   }
 
   QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
     QueueFamilyIndices indices;
-    uint32_t queue_family_count = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
-                                             nullptr);
-    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count,
-                                             queue_families.data());
+    std::vector<VkQueueFamilyProperties> queue_families =
+        queue_family_properties(device);
+    uint32_t queue_family_count =
+        static_cast<uint32_t>(queue_families.size());
+    // Every family is looked at: dedicated compute and transfer families
+    // usually come after the graphics one.
+    std::optional<uint32_t> dedicatedCompute;
+    std::optional<uint32_t> dedicatedTransfer;
+    bool graphicsComputes = false;
     VkBool32 present_support = false;
-    int i = 0;
-    for (const auto &queue_family : queue_families) {
-
-      if (queue_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-
-        indices.graphicsFamily = i;
-      }
-      vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-                                           &present_support);
-      if (present_support) {
-        indices.presentFamily = i;
+    for (uint32_t i = 0; i < queue_family_count; ++i) {
+      VkQueueFlags flags = queue_families[i].queueFlags;
+      if (flags & VK_QUEUE_GRAPHICS_BIT) {
+        if (!indices.graphicsFamily) {
+          indices.graphicsFamily = i;
+          graphicsComputes = (flags & VK_QUEUE_COMPUTE_BIT) != 0;
+        }
+      } else if (flags & VK_QUEUE_COMPUTE_BIT) {
+        if (!dedicatedCompute) {
+          dedicatedCompute = i;
+        }
+      } else if (flags & VK_QUEUE_TRANSFER_BIT) {
+        if (!dedicatedTransfer) {
+          dedicatedTransfer = i;
+        }
       }
-      if (indices.isComplete()) {
-        break;
+      if (!config.headless) {
+        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                             &present_support);
+        // Presenting from the graphics queue avoids a semaphore hop.
+        if (present_support &&
+            (!indices.presentFamily || indices.graphicsFamily == i)) {
+          indices.presentFamily = i;
+        }
       }
-      i++;
+    }
+    if (!indices.graphicsFamily) {
+      return indices;
     }
 
+    if (graphicsComputes) {
+      indices.computeFamily = indices.graphicsFamily;
+    }
+    indices.transferFamily = indices.graphicsFamily;
+    if (!config.single_queue) {
+      if (dedicatedCompute) {
+        indices.computeFamily = dedicatedCompute;
+      }
+      if (dedicatedTransfer) {
+        indices.transferFamily = dedicatedTransfer;
+      }
+    }
     return indices;
   }
 
@@ -736,16 +3156,103 @@ private:
     std::multimap<int, VkPhysicalDevice> candidates;
     for (auto &device : devices) {
       int score = rate_device_suitability(device);
-      candidates.insert(std::make_pair(score, device));
+      if (score > 0) {
+        candidates.insert(std::make_pair(score, device));
+      }
     }
-    if (candidates.rbegin()->first > 0) {
-      physical_device = candidates.rbegin()->second;
-    } else {
+    if (candidates.empty()) {
       throw std::runtime_error{"Failed to find a suitable GPU!"};
     }
-    if (physical_device == VK_NULL_HANDLE) {
-      throw std::runtime_error{"Failed to find a suitable GPU!"};
+    physical_device = candidates.rbegin()->second;
+    if (config.device_benchmark && candidates.size() > 1) {
+      physical_device = pick_benchmarked_device(candidates);
+    }
+  }
+
+  // Benchmarks every candidate, or takes its result from the cache file,
+  // and returns the fastest. A device the benchmark fails on is ranked
+  // last.
+  VkPhysicalDevice pick_benchmarked_device(
+      const std::multimap<int, VkPhysicalDevice> &candidates) {
+    DeviceBenchmark benchmark{config.device_benchmark_file};
+    VkPhysicalDevice best = candidates.rbegin()->second;
+    double best_score = -1.0;
+    for (const auto &[rating, device] : candidates) {
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(device, &properties);
+      DeviceBenchmarkResult result;
+      try {
+        result = benchmark.measure(
+            device, findQueueFamilies(device).graphicsFamily.value());
+      } catch (const std::exception &e) {
+        std::cerr << "Benchmark of " << properties.deviceName
+                  << " failed: " << e.what() << std::endl;
+      }
+      std::cout << std::fixed << std::setprecision(3) << "Benchmark "
+                << properties.deviceName << ": " << result.fill_gpixels
+                << " Gpixels/s fill, " << result.mtriangles
+                << " Mtriangles/s" << (result.cached ? " (cached)" : "")
+                << std::endl;
+      if (result.score() > best_score) {
+        best_score = result.score();
+        best = device;
+      }
+    }
+    benchmark.save();
+    return best;
+  }
+
+  // All synchronization is built on timeline semaphores.
+  static bool
+  supports_timeline_semaphores(VkPhysicalDevice device,
+                               const VkPhysicalDeviceProperties &properties) {
+    if (properties.apiVersion < VK_API_VERSION_1_2) {
+      return false;
+    }
+    VkPhysicalDeviceVulkan12Features vulkan12Features{};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &vulkan12Features;
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    return vulkan12Features.timelineSemaphore == VK_TRUE;
+  }
+
+  // Only what the renderer uses with the current options is required.
+  // Optional features, such as multi-draw indirect for --gpu-cull, are
+  // enabled in create_logical_device when present.
+  bool
+  supports_required_features(VkPhysicalDevice device,
+                             const VkPhysicalDeviceProperties &properties) {
+    if (!supports_timeline_semaphores(device, properties)) {
+      return false;
     }
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(device, &features);
+    if (config.pipeline_variant.polygon_mode != VK_POLYGON_MODE_FILL &&
+        !features.fillModeNonSolid) {
+      return false;
+    }
+    // The culled draws of every mesh after the first start at a nonzero
+    // firstInstance.
+    if (config.gpu_cull && !features.drawIndirectFirstInstance) {
+      return false;
+    }
+
+    QueueFamilyIndices indices = findQueueFamilies(device);
+    if (config.gpu_animate && !indices.computeFamily) {
+      return false;
+    }
+    if (config.gpu_cull && indices.graphicsFamily) {
+      std::vector<VkQueueFamilyProperties> families =
+          queue_family_properties(device);
+      if (!(families[*indices.graphicsFamily].queueFlags &
+            VK_QUEUE_COMPUTE_BIT)) {
+        return false;
+      }
+    }
+    return true;
   }
 
   int rate_device_suitability(VkPhysicalDevice device) {
@@ -753,10 +3260,7 @@ private:
     VkPhysicalDeviceProperties deviceProperties;
     vkGetPhysicalDeviceProperties(device, &deviceProperties);
 
-    VkPhysicalDeviceFeatures deviceFeatures;
-    vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
-
-    if (!deviceFeatures.geometryShader) {
+    if (!supports_required_features(device, deviceProperties)) {
       return 0;
     }
     if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
@@ -765,12 +3269,15 @@ private:
     score += deviceProperties.limits.maxImageDimension2D;
 
     QueueFamilyIndices indices = findQueueFamilies(device);
-    if (!indices.isComplete()) {
+    if (!indices.isComplete(!config.headless)) {
       return 0;
     }
     if (!checkDeviceExtensionSupport(device)) {
       return 0;
     }
+    if (config.headless) {
+      return score;
+    }
 
     SwapchainSupportDetails swapchainSupport = querySwapchainSupport(device);
     if (swapchainSupport.formats.empty() ||
@@ -793,6 +3300,13 @@ private:
     }
   */
 
+  std::vector<const char *> get_required_device_extensions() {
+    if (config.headless) {
+      return {};
+    }
+    return device_extensions;
+  }
+
   bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
     uint32_t extension_count;
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
@@ -800,6 +3314,7 @@ private:
     std::vector<VkExtensionProperties> available_extensions(extension_count);
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
                                          available_extensions.data());
+    auto device_extensions = get_required_device_extensions();
     std::set<std::string> required_extensions(device_extensions.begin(),
                                               device_extensions.end());
     for (const auto &extension : available_extensions) {
@@ -854,7 +3369,8 @@ private:
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "No Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    // Timeline semaphores are core in 1.2.
+    appInfo.apiVersion = VK_API_VERSION_1_2;
 
     VkInstanceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -907,11 +3423,15 @@ private:
   }
 
   std::vector<const char *> get_required_extensions() {
-    uint32_t glfw_extension_count = 0;
-    const char **glfw_extensions;
-    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
-    std::vector<const char *> extensions(
-        glfw_extensions, glfw_extensions + glfw_extension_count);
+    std::vector<const char *> extensions;
+    if (!config.headless) {
+      uint32_t glfw_extension_count = 0;
+      const char **glfw_extensions;
+      glfw_extensions =
+          glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+      extensions.assign(glfw_extensions,
+                        glfw_extensions + glfw_extension_count);
+    }
     if (enableValidationLayers) {
       extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
     }
@@ -933,39 +3453,349 @@ private:
   }
 
   void main_loop() {
-    while (!glfwWindowShouldClose(window)) {
-      glfwPollEvents();
-      drawFrame();
+    if (config.frames_in_flight_sweep) {
+      run_frames_in_flight_sweep();
+      return;
+    }
+    if (config.instance_sweep) {
+      run_instance_sweep();
+      return;
+    }
+    if (config.record_threads_sweep) {
+      run_record_threads_sweep();
+      return;
+    }
+    if (!config.benchmark_file.empty()) {
+      run_benchmark();
+      return;
+    }
+    uint32_t frame_count = config.frame_count;
+    if (config.headless && frame_count == 0) {
+      frame_count = headless_default_frames;
     }
+    run_frames(frame_count);
+    finish_frames();
+    print_frame_stats();
+  }
+
+  // Waits for all submitted frames and consumes any pending readbacks.
+  void finish_frames() {
     vkDeviceWaitIdle(device);
+    profiler.collect_all();
+    if (config.headless) {
+      drain_readbacks();
+    }
+  }
+
+  // Draws until the window closes or frame_count frames have been timed,
+  // after skipping warmup_frames.
+  void run_frames(uint32_t frame_count, uint32_t warmup_frames = 0) {
+    frame_stats.clear();
+    FrameLimiter limiter{config.fps_limit};
+    auto last = std::chrono::steady_clock::now();
+    uint32_t frame = 0;
+    while (config.headless || !glfwWindowShouldClose(window)) {
+      // Limit before polling so input is sampled as late as possible.
+      limiter.wait();
+      if (!config.headless) {
+        glfwPollEvents();
+      }
+      drawFrame();
+
+      auto now = std::chrono::steady_clock::now();
+      if (frame == warmup_frames) {
+        profiler.reset_stats();
+      }
+      if (frame >= warmup_frames) {
+        frame_stats.add(
+            std::chrono::duration<double, std::milli>(now - last).count());
+      }
+      last = now;
+      ++frame;
+      if (frame_count != 0 && frame >= frame_count + warmup_frames) {
+        break;
+      }
+    }
+  }
+
+  void run_frames_in_flight_sweep() {
+    uint32_t frame_count =
+        config.frame_count != 0 ? config.frame_count : sweep_default_frames;
+    double baseline_ms = 0.0;
+    std::cout << "frames in flight | mean frame time | fps     | speedup\n";
+    for (uint32_t frames_in_flight = 1; frames_in_flight <= 3;
+         ++frames_in_flight) {
+      vkDeviceWaitIdle(device);
+      destroy_frame_resources();
+      create_frame_resources(frames_in_flight);
+
+      run_frames(frame_count, sweep_warmup_frames);
+      finish_frames();
+      if (frame_stats.frame_times_ms.empty()) {
+        break;
+      }
+      if (frames_in_flight == 1) {
+        baseline_ms = frame_stats.mean_ms();
+      }
+      std::cout << std::fixed << std::setprecision(3) << std::setw(16)
+                << frames_in_flight << " | " << std::setw(12)
+                << frame_stats.mean_ms() << " ms | " << std::setw(7)
+                << frame_stats.fps() << " | " << std::setw(6)
+                << baseline_ms / frame_stats.mean_ms() << "x\n";
+    }
+  }
+
+  // Redraws the scene with 1, 10, ... 10^6 instances per mesh and reports
+  // the frame time at each step.
+  void run_instance_sweep() {
+    uint32_t frame_count =
+        config.frame_count != 0 ? config.frame_count : sweep_default_frames;
+    uint64_t triangles_per_instance = 0;
+    for (const auto &mesh : scene_meshes) {
+      triangles_per_instance += mesh.indexCount / 3;
+    }
+    std::cout << "instances | mean frame time | fps     | triangles/s\n";
+    for (uint32_t count = 1; count <= max_sweep_instances; count *= 10) {
+      replace_instance_buffer(count);
+
+      run_frames(frame_count, sweep_warmup_frames);
+      finish_frames();
+      if (frame_stats.frame_times_ms.empty()) {
+        break;
+      }
+      std::cout << std::fixed << std::setprecision(3) << std::setw(9) << count
+                << " | " << std::setw(12) << frame_stats.mean_ms() << " ms | "
+                << std::setw(7) << frame_stats.fps() << " | "
+                << std::scientific << std::setprecision(3)
+                << frame_stats.fps() * triangles_per_instance * count << "\n";
+    }
+  }
+
+  // Records the scene inline, then with 1, 2, 4, ... workers up to the
+  // hardware thread count, and reports the CPU recording time of each.
+  // Worth it with many draws, i.e. many meshes or --viewports.
+  void run_record_threads_sweep() {
+    uint32_t frame_count =
+        config.frame_count != 0 ? config.frame_count : sweep_default_frames;
+    uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double baseline_ms = 0.0;
+    std::cout << "record threads | mean recording time | mean frame time "
+                 "| speedup\n";
+    for (uint32_t threads = 0; threads <= max_threads;
+         threads = threads == 0 ? 1 : threads * 2) {
+      vkDeviceWaitIdle(device);
+      destroy_frame_resources();
+      record_workers.reset();
+      if (threads > 0) {
+        record_workers = std::make_unique<ThreadPool>(threads);
+      }
+      create_frame_resources(max_frames_in_flight);
+
+      run_frames(frame_count, sweep_warmup_frames);
+      finish_frames();
+      if (frame_stats.frame_times_ms.empty()) {
+        break;
+      }
+      if (threads == 0) {
+        baseline_ms = frame_stats.mean_record_ms();
+      }
+      std::cout << std::fixed << std::setprecision(3) << std::setw(14)
+                << (threads == 0 ? std::string{"inline"}
+                                 : std::to_string(threads))
+                << " | " << std::setw(16) << frame_stats.mean_record_ms()
+                << " ms | " << std::setw(12) << frame_stats.mean_ms()
+                << " ms | " << std::setw(6)
+                << baseline_ms / frame_stats.mean_record_ms() << "x\n";
+    }
+  }
+
+  // Draws the configured scene for a fixed number of frames after a warmup
+  // and writes the results. Animation time derives from the frame number,
+  // so every run renders the same frames.
+  void run_benchmark() {
+    uint32_t frame_count = config.frame_count != 0 ? config.frame_count
+                                                   : benchmark_default_frames;
+    profiler.keep_frame_times(true);
+    run_frames(frame_count, benchmark_warmup_frames);
+    finish_frames();
+    print_frame_stats();
+    write_benchmark_results(frame_count);
+  }
+
+  void write_benchmark_results(uint32_t frame_count) {
+    std::ofstream file(config.benchmark_file, std::ios::trunc);
+    if (!file.is_open()) {
+      throw std::runtime_error{"Failed to open " + config.benchmark_file};
+    }
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    std::string device_name;
+    for (const char *c = properties.deviceName; *c != '\0'; ++c) {
+      if (*c == '"' || *c == '\\') {
+        device_name += '\\';
+      }
+      device_name += *c;
+    }
+
+    auto write_times = [&](const char *name, const FrameStats &stats) {
+      file << "  \"" << name << "\": {\"min\": " << stats.percentile_ms(0)
+           << ", \"mean\": " << stats.mean_ms()
+           << ", \"p50\": " << stats.percentile_ms(50)
+           << ", \"p99\": " << stats.percentile_ms(99)
+           << ", \"max\": " << stats.percentile_ms(100) << ", \"samples\": [";
+      for (size_t i = 0; i < stats.frame_times_ms.size(); ++i) {
+        file << (i == 0 ? "" : ", ") << stats.frame_times_ms[i];
+      }
+      file << "]}";
+    };
+
+    FrameStats gpu_stats;
+    gpu_stats.frame_times_ms = profiler.gpu_frame_times_ms();
+    file << std::setprecision(6) << "{\n"
+         << "  \"device\": \"" << device_name << "\",\n"
+         << "  \"driver_version\": " << properties.driverVersion << ",\n"
+         << "  \"config\": {\"instances\": " << config.instance_count
+         << ", \"frames_in_flight\": " << max_frames_in_flight
+         << ", \"msaa_samples\": " << msaa_samples
+         << ", \"viewports\": " << config.viewport_count
+         << ", \"record_threads\": " << config.record_threads
+         << ", \"gpu_animate\": " << (config.gpu_animate ? "true" : "false")
+         << ", \"gpu_cull\": " << (config.gpu_cull ? "true" : "false")
+         << "},\n"
+         << "  \"warmup_frames\": " << benchmark_warmup_frames << ",\n"
+         << "  \"frames\": " << frame_count << ",\n"
+         << "  \"startup_ms\": " << startup.first_frame_ms() << ",\n";
+    write_times("cpu_frame_ms", frame_stats);
+    if (!gpu_stats.frame_times_ms.empty()) {
+      file << ",\n";
+      write_times("gpu_frame_ms", gpu_stats);
+    }
+    file << "\n}\n";
+    std::cout << "Benchmark results written to " << config.benchmark_file
+              << std::endl;
+  }
+
+  void print_frame_stats() {
+    if (frame_stats.frame_times_ms.empty()) {
+      return;
+    }
+    std::cout << std::fixed << std::setprecision(3)
+              << "Frames in flight: " << max_frames_in_flight
+              << ", frames: " << frame_stats.frame_times_ms.size()
+              << ", mean frame time: " << frame_stats.mean_ms() << " ms ("
+              << frame_stats.fps() << " fps)" << std::endl;
+    std::cout << "Frame time p50: " << frame_stats.percentile_ms(50)
+              << " ms, p99: " << frame_stats.percentile_ms(99)
+              << " ms, max: " << frame_stats.percentile_ms(100) << " ms"
+              << std::endl;
+    if (config.frame_histogram) {
+      frame_stats.print_histogram(std::cout);
+    }
+    std::cout << "Mean recording time: " << frame_stats.mean_record_ms()
+              << " ms ("
+              << (record_workers ? std::to_string(record_workers->size()) +
+                                       " threads"
+                                 : std::string{"inline"})
+              << ")" << std::endl;
+    PipelineRegistry::Stats pipelineStats = pipelines.stats();
+    std::cout << "Pipeline variants: " << pipelineStats.ready << " ready, "
+              << pipelineStats.compiling << " compiling, "
+              << pipelineStats.failed << " failed, "
+              << pipelineStats.compile_ms << " ms compiling in the background; "
+              << pipelineStats.fallback_uses
+              << " frames drawn with the fallback" << std::endl;
+    Profiler::GpuStats gpu = profiler.gpu_stats();
+    if (gpu.frames > 0) {
+      std::cout << "Mean GPU frame time: " << gpu.frame_ms
+                << " ms, render pass: " << gpu.render_pass_ms << " ms"
+                << std::endl;
+    }
+    if (profiler.dropped_events() > 0) {
+      std::cout << "Trace events dropped: " << profiler.dropped_events()
+                << std::endl;
+    }
+    if (config.headless) {
+      std::cout << "Frames read back: " << frames_read_back
+                << ", last checksum: 0x" << std::hex << last_checksum
+                << std::dec << std::endl;
+    }
   }
 
   void cleanup() {
-    vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
-    vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-    vkDestroyFence(device, inFlightFence, nullptr);
+    shader_watcher.reset();
+    destroy_frame_resources();
+    for (auto &retired : retiredSwapchains) {
+      retired();
+    }
+    retiredSwapchains.clear();
+    deletions.flush();
+    record_workers.reset();
     vkDestroyCommandPool(device, commandPool, nullptr);
+    staging.destroy();
+    allocator.destroy_buffer(vertexBuffer, vertexBufferMemory);
+    allocator.destroy_buffer(indexBuffer, indexBufferMemory);
+    destroy_instance_buffer();
     for (auto &framebuffer : swapchainFramebuffers) {
       vkDestroyFramebuffer(device, framebuffer, nullptr);
     }
-    vkDestroyPipeline(device, graphicsPipeline, nullptr);
+    pipelines.destroy();
+    compile_workers.reset();
+    if (config.gpu_animate) {
+      destroy_compute_pipeline();
+    }
+    if (config.gpu_cull) {
+      destroy_cull_pipeline();
+      allocator.destroy_buffer(meshBoundsBuffer, meshBoundsMemory);
+    }
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, uniformSetLayout, nullptr);
+    save_pipeline_cache();
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
     vkDestroyRenderPass(device, renderPass, nullptr);
     for (auto image_view : swapchain_image_views) {
       vkDestroyImageView(device, image_view, nullptr);
     }
+    destroy_render_target(msaaTarget);
+    destroy_render_target(depthTarget);
 
-    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    if (config.headless) {
+      for (size_t i = 0; i < swapchain_images.size(); ++i) {
+        allocator.destroy_image(swapchain_images[i], offscreen_image_memory[i]);
+      }
+    } else {
+      for (auto semaphore : renderFinishedSemaphores) {
+        vkDestroySemaphore(device, semaphore, nullptr);
+      }
+      vkDestroySwapchainKHR(device, swapchain, nullptr);
+    }
+    if (config.memory_stats) {
+      allocator.print_stats(std::cout);
+    }
+    allocator.destroy();
+    profiler.destroy();
+    for (auto &timeline : queueTimelines) {
+      timeline->destroy();
+    }
+    queueTimelines.clear();
     vkDestroyDevice(device, nullptr);
     if (enableValidationLayers) {
       DestroyDebugUtilsMessengerEXT(instance, debug_messenger, nullptr);
     }
-    vkDestroySurfaceKHR(instance, surface, nullptr); // before vkDestroyInstance
+    if (!config.headless) {
+      vkDestroySurfaceKHR(instance, surface,
+                          nullptr); // before vkDestroyInstance
+    }
     vkDestroyInstance(instance, nullptr);
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!config.headless) {
+      glfwDestroyWindow(window);
+      glfwTerminate();
+    }
   }
 
+  // Declared last so it is destroyed first: if startup throws, the stages
+  // still running are waited for while the state they use is alive.
+  StartupScheduler startup;
+
   static VKAPI_ATTR VkBool32 VKAPI_CALL
   debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
                 VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -974,30 +3804,169 @@ private:
     std::cerr << "validation layer: " << pCallbackData->pMessage << std::endl;
     return VK_FALSE;
   }
+};
 
-  static std::vector<char> readFile(const std::string &dir_path,
-                                    const std::string &filename) {
-    std::stringstream ss;
-    ss << dir_path << "/" << filename;
-    std::ifstream file(ss.str(), std::ios::ate | std::ios::binary);
-
-    if (!file.is_open()) {
-      throw std::runtime_error{"Failed to open file!"};
+AppConfig parse_args(int argc, char **argv) {
+  AppConfig config;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto next_value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error{"Missing value for " + arg};
+      }
+      return argv[++i];
+    };
+    auto next_uint = [&]() -> uint32_t {
+      return static_cast<uint32_t>(std::stoul(next_value()));
+    };
+    if (arg == "--frames-in-flight") {
+      config.frames_in_flight = next_uint();
+      if (config.frames_in_flight == 0) {
+        throw std::runtime_error{"--frames-in-flight must be at least 1"};
+      }
+    } else if (arg == "--frames") {
+      config.frame_count = next_uint();
+    } else if (arg == "--frames-in-flight-sweep") {
+      config.frames_in_flight_sweep = true;
+    } else if (arg == "--headless") {
+      config.headless = true;
+    } else if (arg == "--dump-dir") {
+      config.dump_dir = next_value();
+      // Only offscreen frames are read back.
+      config.headless = true;
+    } else if (arg == "--pipeline-cache") {
+      config.pipeline_cache_file = next_value();
+    } else if (arg == "--device-benchmark") {
+      config.device_benchmark = true;
+    } else if (arg == "--device-benchmark-cache") {
+      config.device_benchmark_file = next_value();
+    } else if (arg == "--benchmark") {
+      config.benchmark_file = next_value();
+      // Nothing outside the application paces the frames, and no display
+      // is needed.
+      config.headless = true;
+    } else if (arg == "--instances") {
+      config.instance_count = next_uint();
+      if (config.instance_count == 0) {
+        throw std::runtime_error{"--instances must be at least 1"};
+      }
+    } else if (arg == "--instance-sweep") {
+      config.instance_sweep = true;
+    } else if (arg == "--record-threads") {
+      config.record_threads = next_uint();
+    } else if (arg == "--record-threads-sweep") {
+      config.record_threads_sweep = true;
+    } else if (arg == "--trace") {
+      config.trace_file = next_value();
+    } else if (arg == "--present-policy") {
+      std::string policy = next_value();
+      if (policy == "mailbox") {
+        config.present_policy = PresentPolicy::Mailbox;
+      } else if (policy == "low-latency") {
+        config.present_policy = PresentPolicy::LowLatency;
+      } else if (policy == "fifo") {
+        config.present_policy = PresentPolicy::PowerSaving;
+      } else if (policy == "fifo-relaxed") {
+        config.present_policy = PresentPolicy::FifoRelaxed;
+      } else {
+        throw std::runtime_error{"Unknown present policy: " + policy};
+      }
+    } else if (arg == "--fps-limit") {
+      config.fps_limit = std::stod(next_value());
+    } else if (arg == "--frame-histogram") {
+      config.frame_histogram = true;
+    } else if (arg == "--viewports") {
+      config.viewport_count = next_uint();
+      if (config.viewport_count == 0) {
+        throw std::runtime_error{"--viewports must be at least 1"};
+      }
+    } else if (arg == "--pipeline-variant") {
+      std::stringstream spec{next_value()};
+      std::string token;
+      while (std::getline(spec, token, ',')) {
+        if (token == "blend") {
+          config.pipeline_variant.blend = true;
+        } else if (token == "line") {
+          config.pipeline_variant.polygon_mode = VK_POLYGON_MODE_LINE;
+        } else if (token == "point") {
+          config.pipeline_variant.polygon_mode = VK_POLYGON_MODE_POINT;
+        } else if (token == "cull-none") {
+          config.pipeline_variant.cull_mode = VK_CULL_MODE_NONE;
+        } else if (token == "cull-front") {
+          config.pipeline_variant.cull_mode = VK_CULL_MODE_FRONT_BIT;
+        } else if (token == "cull-back") {
+          config.pipeline_variant.cull_mode = VK_CULL_MODE_BACK_BIT;
+        } else {
+          throw std::runtime_error{"Unknown pipeline variant state: " + token};
+        }
+      }
+    } else if (arg == "--watch-shaders") {
+      config.watch_shaders = true;
+    } else if (arg == "--gpu-animate") {
+      config.gpu_animate = true;
+    } else if (arg == "--single-queue") {
+      config.single_queue = true;
+    } else if (arg == "--sort-front-to-back") {
+      config.sort_front_to_back = true;
+    } else if (arg == "--gpu-cull") {
+      config.gpu_cull = true;
+    } else if (arg == "--zoom") {
+      config.zoom = std::stof(next_value());
+      if (!(config.zoom > 0.f)) {
+        throw std::runtime_error{"--zoom must be positive"};
+      }
+    } else if (arg == "--msaa") {
+      std::string samples = next_value();
+      if (samples == "max") {
+        config.msaa_samples = 0;
+      } else {
+        config.msaa_samples = static_cast<uint32_t>(std::stoul(samples));
+        if (config.msaa_samples == 0 || config.msaa_samples > 64 ||
+            (config.msaa_samples & (config.msaa_samples - 1)) != 0) {
+          throw std::runtime_error{"--msaa must be a power of two up to 64 "
+                                   "or max"};
+        }
+      }
+    } else if (arg == "--memory-stats") {
+      config.memory_stats = true;
+    } else if (arg == "--print-checksums") {
+      config.print_checksums = true;
+      config.headless = true;
+    } else {
+      throw std::runtime_error{"Unknown argument: " + arg};
     }
-    size_t fileSize = (size_t)file.tellg();
-    std::vector<char> buffer(fileSize);
-
-    file.seekg(0);
-    file.read(buffer.data(), fileSize);
-    file.close();
-
-    return buffer;
   }
-};
+  if (config.record_threads_sweep && config.gpu_cull) {
+    throw std::runtime_error{"--record-threads-sweep has nothing to measure "
+                             "with --gpu-cull"};
+  }
+  if (config.frames_in_flight == 0) {
+    switch (config.present_policy) {
+    case PresentPolicy::Mailbox:
+      // Records the next frame while the GPU draws the current one.
+      config.frames_in_flight = 2;
+      break;
+    case PresentPolicy::LowLatency:
+      // Keeps the CPU at most one frame ahead of the display.
+      config.frames_in_flight = 1;
+      break;
+    case PresentPolicy::PowerSaving:
+      // Acquire already paces the CPU to the display; a second frame lets
+      // it record while the GPU is still busy instead of both stalling.
+      config.frames_in_flight = 2;
+      break;
+    case PresentPolicy::FifoRelaxed:
+      // Keeps the GPU fed, so fewer frames miss vblank in the first place.
+      config.frames_in_flight = 2;
+      break;
+    }
+  }
+  return config;
+}
 
-int main() {
-  HelloTriangleApplication app;
+int main(int argc, char **argv) {
   try {
+    HelloTriangleApplication app{parse_args(argc, argv)};
     app.run();
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
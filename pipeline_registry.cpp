@@ -0,0 +1,442 @@
+#include "pipeline_registry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+uint64_t PipelineKey::hash() const {
+  return static_cast<uint64_t>(blend) |
+         static_cast<uint64_t>(polygon_mode) << 8 |
+         static_cast<uint64_t>(cull_mode) << 16 |
+         static_cast<uint64_t>(samples) << 24;
+}
+
+std::string PipelineKey::name() const {
+  std::string result = blend ? "blend" : "opaque";
+  switch (polygon_mode) {
+  case VK_POLYGON_MODE_LINE:
+    result += " line";
+    break;
+  case VK_POLYGON_MODE_POINT:
+    result += " point";
+    break;
+  default:
+    result += " fill";
+    break;
+  }
+  switch (cull_mode) {
+  case VK_CULL_MODE_NONE:
+    result += " cull-none";
+    break;
+  case VK_CULL_MODE_FRONT_BIT:
+    result += " cull-front";
+    break;
+  case VK_CULL_MODE_BACK_BIT:
+    result += " cull-back";
+    break;
+  default:
+    result += " cull-all";
+    break;
+  }
+  return result + " " + std::to_string(samples) + "x";
+}
+
+void PipelineRegistry::init(VkDevice device, VkPipelineCache cache,
+                            ThreadPool &workers, PipelineShared shared) {
+  device_ = device;
+  cache_ = cache;
+  workers_ = &workers;
+  current_ = std::make_unique<Generation>();
+  current_->shared = std::move(shared);
+}
+
+void PipelineRegistry::destroy() {
+  std::vector<std::future<void>> retiring;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    retiring = std::move(retiring_);
+  }
+  // Not under mutex_, retirements take it to account their compile time.
+  for (auto &retirement : retiring) {
+    retirement.wait();
+  }
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (next_) {
+    destroy_generation(*next_);
+    next_.reset();
+  }
+  if (current_) {
+    destroy_generation(*current_);
+    current_.reset();
+  }
+  render_passes_.clear();
+}
+
+void PipelineRegistry::set_render_pass(VkSampleCountFlagBits samples,
+                                       VkRenderPass render_pass) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  render_passes_[samples] = render_pass;
+}
+
+bool PipelineRegistry::has_render_pass(VkSampleCountFlagBits samples) const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return render_passes_.count(samples) != 0;
+}
+
+uint64_t PipelineRegistry::compile_fallback(const PipelineKey &key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto start = std::chrono::steady_clock::now();
+  auto &entries = current_->entries;
+  auto found = entries.find(key.hash());
+  if (found == entries.end()) {
+    auto pass = render_passes_.find(key.samples);
+    if (pass == render_passes_.end()) {
+      throw std::runtime_error{"No render pass for pipeline " + key.name() +
+                               "!"};
+    }
+    Entry entry{};
+    entry.key = key;
+    entry.pipeline = create(key, pass->second, current_->shared);
+    found = entries.emplace(key.hash(), std::move(entry)).first;
+  } else if (!poll_locked(found->second, true) || found->second.failed) {
+    throw std::runtime_error{"Failed to create graphics pipeline!"};
+  }
+  current_->fallback_key = key;
+  current_->fallback = found->second.pipeline;
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void PipelineRegistry::request(const PipelineKey &key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  request_locked(*current_, key);
+}
+
+VkPipeline PipelineRegistry::get(const PipelineKey &key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  Entry &entry = request_locked(*current_, key);
+  if (entry.pipeline != VK_NULL_HANDLE ||
+      (poll_locked(entry, false) && !entry.failed)) {
+    return entry.pipeline;
+  }
+  ++fallback_uses_;
+  return current_->fallback;
+}
+
+void PipelineRegistry::reload(VkShaderModule vertex_shader,
+                              VkShaderModule fragment_shader) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (next_) {
+    // Superseded before it finished; nothing has drawn with it.
+    retire_locked(std::move(next_));
+  }
+  next_ = std::make_unique<Generation>();
+  next_->shared = current_->shared;
+  next_->shared.vertex_shader = vertex_shader;
+  next_->shared.fragment_shader = fragment_shader;
+  next_->fallback_key = current_->fallback_key;
+  // The fallback first, then everything the current generation has.
+  request_locked(*next_, next_->fallback_key);
+  for (const auto &[hash, entry] : current_->entries) {
+    request_locked(*next_, entry.key);
+  }
+}
+
+bool PipelineRegistry::swap_if_ready(DeletionQueue &deletions,
+                                     uint64_t last_use) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (!next_) {
+    return false;
+  }
+  Entry &fallback = next_->entries.at(next_->fallback_key.hash());
+  if (!poll_locked(fallback, false)) {
+    return false;
+  }
+  if (fallback.failed) {
+    std::cerr << "Reloaded pipelines failed to compile, keeping the old ones"
+              << std::endl;
+    retire_locked(std::move(next_));
+    return false;
+  }
+  next_->fallback = fallback.pipeline;
+  // std::function needs a copyable capture. Variants of the retired
+  // generation may still be compiling, so collecting it only hands it to a
+  // worker.
+  std::shared_ptr<Generation> retired{std::move(current_)};
+  deletions.push(last_use, [this, retired] {
+    std::lock_guard<std::mutex> lock{mutex_};
+    retire_locked(retired);
+  });
+  current_ = std::move(next_);
+  return true;
+}
+
+PipelineRegistry::Stats PipelineRegistry::stats() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  Stats stats;
+  for (const auto &[hash, entry] : current_->entries) {
+    if (entry.pipeline != VK_NULL_HANDLE) {
+      ++stats.ready;
+    } else if (entry.failed) {
+      ++stats.failed;
+    } else {
+      ++stats.compiling;
+    }
+  }
+  stats.compile_ms = compile_ms_;
+  stats.fallback_uses = fallback_uses_;
+  return stats;
+}
+
+PipelineRegistry::Entry &
+PipelineRegistry::request_locked(Generation &generation,
+                                 const PipelineKey &key) {
+  auto found = generation.entries.find(key.hash());
+  if (found != generation.entries.end()) {
+    return found->second;
+  }
+  Entry &entry = generation.entries[key.hash()];
+  entry.key = key;
+  auto pass = render_passes_.find(key.samples);
+  if (pass == render_passes_.end()) {
+    std::cerr << "No render pass for pipeline " << key.name() << std::endl;
+    entry.failed = true;
+    return entry;
+  }
+  VkRenderPass render_pass = pass->second;
+  // Generations are heap allocated and outlive their compilations, see
+  // destroy_generation.
+  const PipelineShared *shared = &generation.shared;
+  entry.pending = workers_->submit([this, key, render_pass, shared] {
+    auto start = std::chrono::steady_clock::now();
+    VkPipeline pipeline = create(key, render_pass, *shared);
+    return Compiled{pipeline,
+                    std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count()};
+  });
+  return entry;
+}
+
+bool PipelineRegistry::poll_locked(Entry &entry, bool wait) {
+  if (entry.pipeline != VK_NULL_HANDLE || entry.failed) {
+    return true;
+  }
+  if (!entry.pending.valid()) {
+    return false;
+  }
+  if (!wait && entry.pending.wait_for(std::chrono::seconds{0}) !=
+                   std::future_status::ready) {
+    return false;
+  }
+  try {
+    Compiled compiled = entry.pending.get();
+    entry.pipeline = compiled.pipeline;
+    compile_ms_ += compiled.compile_ms;
+  } catch (const std::exception &e) {
+    std::cerr << "Pipeline " << entry.key.name() << ": " << e.what()
+              << std::endl;
+    entry.failed = true;
+  }
+  return true;
+}
+
+// Waits for the generation's compilations before destroying anything.
+void PipelineRegistry::destroy_generation(Generation &generation) {
+  for (auto &[hash, entry] : generation.entries) {
+    poll_locked(entry, true);
+    if (entry.pipeline != VK_NULL_HANDLE) {
+      vkDestroyPipeline(device_, entry.pipeline, nullptr);
+    }
+  }
+  generation.entries.clear();
+  vkDestroyShaderModule(device_, generation.shared.vertex_shader, nullptr);
+  vkDestroyShaderModule(device_, generation.shared.fragment_shader, nullptr);
+}
+
+void PipelineRegistry::retire_locked(std::shared_ptr<Generation> generation) {
+  retiring_.erase(std::remove_if(retiring_.begin(), retiring_.end(),
+                                 [](const std::future<void> &retirement) {
+                                   return retirement.wait_for(
+                                              std::chrono::seconds{0}) ==
+                                          std::future_status::ready;
+                                 }),
+                  retiring_.end());
+  // The pool runs tasks in submission order, so every compilation of the
+  // generation has started before this task does and it cannot deadlock
+  // waiting for one.
+  retiring_.push_back(workers_->submit([this, generation] {
+    double compile_ms = 0.0;
+    for (auto &[hash, entry] : generation->entries) {
+      if (entry.pending.valid()) {
+        try {
+          Compiled compiled = entry.pending.get();
+          entry.pipeline = compiled.pipeline;
+          compile_ms += compiled.compile_ms;
+        } catch (const std::exception &) {
+          // Nothing used it, so the error does not matter anymore.
+        }
+      }
+      if (entry.pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(device_, entry.pipeline, nullptr);
+      }
+    }
+    vkDestroyShaderModule(device_, generation->shared.vertex_shader, nullptr);
+    vkDestroyShaderModule(device_, generation->shared.fragment_shader,
+                          nullptr);
+    std::lock_guard<std::mutex> lock{mutex_};
+    compile_ms_ += compile_ms;
+  }));
+}
+
+VkPipeline PipelineRegistry::create(const PipelineKey &key,
+                                    VkRenderPass render_pass,
+                                    const PipelineShared &shared) const {
+  VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+  vertShaderStageInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  vertShaderStageInfo.module = shared.vertex_shader;
+  vertShaderStageInfo.pName = "main";
+
+  VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+  fragShaderStageInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  fragShaderStageInfo.module = shared.fragment_shader;
+  fragShaderStageInfo.pName = "main";
+
+  VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
+                                                    fragShaderStageInfo};
+
+  VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+  vertexInputInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertexInputInfo.vertexBindingDescriptionCount =
+      static_cast<uint32_t>(shared.bindings.size());
+  vertexInputInfo.pVertexBindingDescriptions = shared.bindings.data();
+  vertexInputInfo.vertexAttributeDescriptionCount =
+      static_cast<uint32_t>(shared.attributes.size());
+  vertexInputInfo.pVertexAttributeDescriptions = shared.attributes.data();
+
+  VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+  inputAssembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+  // Viewport and scissor are dynamic so pipelines survive resizes.
+  VkPipelineViewportStateCreateInfo viewportState{};
+  viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportState.viewportCount = 1;
+  viewportState.pViewports = nullptr;
+  viewportState.scissorCount = 1;
+  viewportState.pScissors = nullptr;
+
+  VkPipelineRasterizationStateCreateInfo rasterizer{};
+  rasterizer.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizer.depthClampEnable = VK_FALSE;
+  rasterizer.rasterizerDiscardEnable = VK_FALSE;
+  rasterizer.polygonMode = key.polygon_mode;
+  rasterizer.lineWidth = 1.f;
+  rasterizer.cullMode = key.cull_mode;
+  rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  rasterizer.depthBiasEnable = VK_FALSE;
+  rasterizer.depthBiasConstantFactor = 0.f;
+  rasterizer.depthBiasClamp = 0.f;
+  rasterizer.depthBiasSlopeFactor = 0.f;
+
+  VkPipelineMultisampleStateCreateInfo multisampling{};
+  multisampling.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampling.sampleShadingEnable = VK_FALSE;
+  multisampling.rasterizationSamples = key.samples;
+  multisampling.minSampleShading = 1.f;
+  multisampling.pSampleMask = nullptr;
+  multisampling.alphaToCoverageEnable = VK_FALSE;
+  multisampling.alphaToOneEnable = VK_FALSE;
+
+  // The fragment shader neither discards nor writes depth, so drivers can
+  // run the test before shading.
+  VkPipelineDepthStencilStateCreateInfo depthStencil{};
+  depthStencil.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depthStencil.depthTestEnable = VK_TRUE;
+  // Blended geometry is tested against opaque depth but must not occlude
+  // what is drawn behind it afterwards.
+  depthStencil.depthWriteEnable = key.blend ? VK_FALSE : VK_TRUE;
+  depthStencil.depthCompareOp = shared.depth_compare;
+  depthStencil.depthBoundsTestEnable = VK_FALSE;
+  depthStencil.stencilTestEnable = VK_FALSE;
+
+  VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+  colorBlendAttachment.colorWriteMask =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  if (key.blend) {
+    colorBlendAttachment.blendEnable = VK_TRUE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorBlendAttachment.dstColorBlendFactor =
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+  } else {
+    colorBlendAttachment.blendEnable = VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+  }
+  colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+  colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+  colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+  colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+  VkPipelineColorBlendStateCreateInfo colorBlending{};
+  colorBlending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  colorBlending.logicOpEnable = VK_FALSE;
+  colorBlending.logicOp = VK_LOGIC_OP_COPY;
+  colorBlending.attachmentCount = 1;
+  colorBlending.pAttachments = &colorBlendAttachment;
+  colorBlending.blendConstants[0] = 0.f;
+  colorBlending.blendConstants[1] = 0.f;
+  colorBlending.blendConstants[2] = 0.f;
+  colorBlending.blendConstants[3] = 0.f;
+
+  VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT,
+                                    VK_DYNAMIC_STATE_SCISSOR};
+  VkPipelineDynamicStateCreateInfo dynamicState{};
+  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = 2;
+  dynamicState.pDynamicStates = dynamicStates;
+
+  VkGraphicsPipelineCreateInfo pipelineInfo{};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.stageCount = 2;
+  pipelineInfo.pStages = shaderStages;
+
+  pipelineInfo.pVertexInputState = &vertexInputInfo;
+  pipelineInfo.pInputAssemblyState = &inputAssembly;
+  pipelineInfo.pViewportState = &viewportState;
+  pipelineInfo.pRasterizationState = &rasterizer;
+  pipelineInfo.pMultisampleState = &multisampling;
+  pipelineInfo.pDepthStencilState = &depthStencil;
+  pipelineInfo.pColorBlendState = &colorBlending;
+  pipelineInfo.pDynamicState = &dynamicState;
+
+  pipelineInfo.layout = shared.layout;
+
+  pipelineInfo.renderPass = render_pass;
+  pipelineInfo.subpass = 0;
+
+  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+  pipelineInfo.basePipelineIndex = -1;
+
+  // VkPipelineCache is internally synchronized, all workers share it.
+  VkPipeline pipeline;
+  if (vkCreateGraphicsPipelines(device_, cache_, 1, &pipelineInfo, nullptr,
+                                &pipeline) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create graphics pipeline!"};
+  }
+  return pipeline;
+}
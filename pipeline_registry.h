@@ -0,0 +1,151 @@
+#ifndef PIPELINE_REGISTRY_H
+#define PIPELINE_REGISTRY_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "deletion_queue.h"
+#include "thread_pool.h"
+
+// Fixed-function state that differs between pipeline variants.
+struct PipelineKey {
+  bool blend = false;
+  VkPolygonMode polygon_mode = VK_POLYGON_MODE_FILL;
+  VkCullModeFlags cull_mode = VK_CULL_MODE_BACK_BIT;
+  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+
+  // Packs every field into distinct bits, so different keys never collide.
+  uint64_t hash() const;
+  bool operator==(const PipelineKey &other) const {
+    return hash() == other.hash();
+  }
+  // Short human-readable description, e.g. "blend line cull-none 4x".
+  std::string name() const;
+};
+
+// State shared by every variant. The registry takes ownership of the shader
+// modules; the layout stays owned by the caller.
+struct PipelineShared {
+  VkShaderModule vertex_shader = VK_NULL_HANDLE;
+  VkShaderModule fragment_shader = VK_NULL_HANDLE;
+  VkPipelineLayout layout = VK_NULL_HANDLE;
+  std::vector<VkVertexInputBindingDescription> bindings;
+  std::vector<VkVertexInputAttributeDescription> attributes;
+  // Every variant tests and writes depth. Reversed-Z: depth is cleared to
+  // 0 and nearer fragments have greater depth.
+  VkCompareOp depth_compare = VK_COMPARE_OP_GREATER;
+};
+
+// Owns every graphics pipeline variant. Variants are compiled on a thread
+// pool through one shared VkPipelineCache; until a requested variant is
+// ready, get() hands out the fallback variant so the frame loop never
+// waits for the compiler.
+//
+// reload() starts a new generation of pipelines built from new shaders in
+// the background. The render thread switches to it with swap_if_ready() at
+// a frame boundary once its fallback has compiled; the old generation goes
+// to a deletion queue and is destroyed when the frames using it finish.
+class PipelineRegistry {
+public:
+  struct Stats {
+    size_t ready = 0;
+    size_t compiling = 0;
+    size_t failed = 0;
+    // Summed over all finished background compilations.
+    double compile_ms = 0.0;
+    // get() calls answered with the fallback.
+    uint64_t fallback_uses = 0;
+  };
+
+  PipelineRegistry() = default;
+  PipelineRegistry(const PipelineRegistry &) = delete;
+  PipelineRegistry &operator=(const PipelineRegistry &) = delete;
+
+  void init(VkDevice device, VkPipelineCache cache, ThreadPool &workers,
+            PipelineShared shared);
+  // Waits for running compilations and retirements, then destroys every
+  // pipeline and the shader modules of the current and any reloading
+  // generation. Generations handed to a deletion queue must have been
+  // destroyed before.
+  void destroy();
+
+  // Render pass that variants with this sample count are compiled against.
+  void set_render_pass(VkSampleCountFlagBits samples, VkRenderPass render_pass);
+  bool has_render_pass(VkSampleCountFlagBits samples) const;
+
+  // Compiles key on the calling thread unless it is already known, and
+  // makes it the fallback. Returns the creation time in microseconds.
+  uint64_t compile_fallback(const PipelineKey &key);
+  // Starts compiling key in the background unless it is already known.
+  void request(const PipelineKey &key);
+  // The pipeline for key if it has finished compiling, otherwise the
+  // fallback. Unknown keys are requested.
+  VkPipeline get(const PipelineKey &key);
+
+  // Compiles the fallback and every variant of the current generation
+  // again with new shaders, taking ownership of the modules.
+  void reload(VkShaderModule vertex_shader, VkShaderModule fragment_shader);
+  // Makes the reloaded generation current once its fallback is ready. A
+  // generation that failed to compile is dropped and the current one
+  // stays. The replaced generation is queued on deletions, tagged with
+  // last_use, the timeline value of the last submission that may use it.
+  // Returns true when the pipelines changed.
+  bool swap_if_ready(DeletionQueue &deletions, uint64_t last_use);
+
+  Stats stats() const;
+
+private:
+  struct Compiled {
+    VkPipeline pipeline;
+    double compile_ms;
+  };
+  struct Entry {
+    PipelineKey key;
+    std::future<Compiled> pending;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    bool failed = false;
+  };
+
+  // Every pipeline built from one set of shader modules.
+  struct Generation {
+    PipelineShared shared;
+    std::unordered_map<uint64_t, Entry> entries;
+    PipelineKey fallback_key;
+    VkPipeline fallback = VK_NULL_HANDLE;
+  };
+
+  // Thread-safe: only reads immutable state.
+  VkPipeline create(const PipelineKey &key, VkRenderPass render_pass,
+                    const PipelineShared &shared) const;
+  Entry &request_locked(Generation &generation, const PipelineKey &key);
+  // Moves a finished compilation into entry.pipeline. Returns whether the
+  // entry is settled (ready or failed).
+  bool poll_locked(Entry &entry, bool wait);
+  void destroy_generation(Generation &generation);
+  // Destroys a generation nothing draws with on a worker, once its
+  // compilations finish, so the caller never waits for the compiler.
+  void retire_locked(std::shared_ptr<Generation> generation);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkPipelineCache cache_ = VK_NULL_HANDLE;
+  ThreadPool *workers_ = nullptr;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, VkRenderPass> render_passes_;
+  std::unique_ptr<Generation> current_;
+  // Reloaded generation still compiling its fallback.
+  std::unique_ptr<Generation> next_;
+  // Workers destroying retired generations.
+  std::vector<std::future<void>> retiring_;
+  double compile_ms_ = 0.0;
+  uint64_t fallback_uses_ = 0;
+};
+
+#endif // PIPELINE_REGISTRY_H
@@ -0,0 +1,219 @@
+#include "profiler.h"
+
+#include <iomanip>
+#include <stdexcept>
+
+namespace {
+
+constexpr int trace_pid = 1;
+constexpr int cpu_tid = 1;
+constexpr int gpu_tid = 2;
+
+} // namespace
+
+Profiler::~Profiler() { destroy(); }
+
+void Profiler::init(VkPhysicalDevice physical_device, VkDevice device,
+                    uint32_t queue_family) {
+  device_ = device;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  timestamp_period_ns_ = properties.limits.timestampPeriod;
+
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                           families.data());
+  uint32_t valid_bits = families[queue_family].timestampValidBits;
+  gpu_enabled_ = valid_bits != 0;
+  timestamp_mask_ = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+}
+
+void Profiler::destroy() {
+  if (writer_.joinable()) {
+    stop_writer_ = true;
+    writer_.join();
+    trace_ << "\n]\n";
+    trace_.close();
+  }
+}
+
+void Profiler::open_trace(const std::string &path) {
+  trace_.open(path, std::ios::trunc);
+  if (!trace_) {
+    throw std::runtime_error{"Failed to open trace file " + path + "!"};
+  }
+  trace_ << std::fixed << std::setprecision(3) << "[\n"
+         << R"({"name":"thread_name","ph":"M","pid":)" << trace_pid
+         << R"(,"tid":)" << cpu_tid << R"(,"args":{"name":"CPU"}},)" << "\n"
+         << R"({"name":"thread_name","ph":"M","pid":)" << trace_pid
+         << R"(,"tid":)" << gpu_tid << R"(,"args":{"name":"GPU"}})";
+  stop_writer_ = false;
+  writer_ = std::thread{[this] { writer_loop(); }};
+}
+
+void Profiler::create_queries(uint32_t frames_in_flight) {
+  slots_.assign(frames_in_flight, QuerySlot{});
+  if (!gpu_enabled_) {
+    return;
+  }
+  VkQueryPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  poolInfo.queryCount = frames_in_flight * marks_per_frame;
+  if (vkCreateQueryPool(device_, &poolInfo, nullptr, &query_pool_) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create timestamp query pool!"};
+  }
+}
+
+void Profiler::destroy_queries() {
+  if (query_pool_ != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(device_, query_pool_, nullptr);
+    query_pool_ = VK_NULL_HANDLE;
+  }
+  slots_.clear();
+}
+
+void Profiler::begin_commands(VkCommandBuffer command_buffer, uint32_t slot,
+                              uint64_t frame) {
+  slots_[slot].pending = false;
+  slots_[slot].frame = frame;
+  if (!gpu_enabled_) {
+    return;
+  }
+  vkCmdResetQueryPool(command_buffer, query_pool_, slot * marks_per_frame,
+                      marks_per_frame);
+  mark(command_buffer, slot, GpuMark::FrameBegin);
+}
+
+void Profiler::mark(VkCommandBuffer command_buffer, uint32_t slot,
+                    GpuMark mark) {
+  if (!gpu_enabled_) {
+    return;
+  }
+  // Begin marks are taken as soon as the GPU reaches the command, end marks
+  // once all previous work has finished.
+  VkPipelineStageFlagBits stage =
+      mark == GpuMark::FrameBegin || mark == GpuMark::RenderPassBegin
+          ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+          : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  vkCmdWriteTimestamp(command_buffer, stage, query_pool_,
+                      slot * marks_per_frame + static_cast<uint32_t>(mark));
+}
+
+void Profiler::submitted(uint32_t slot) {
+  slots_[slot].pending = true;
+  slots_[slot].submit_ns = now_ns();
+}
+
+void Profiler::collect(uint32_t slot) {
+  QuerySlot &query_slot = slots_[slot];
+  if (!query_slot.pending || !gpu_enabled_) {
+    return;
+  }
+  query_slot.pending = false;
+
+  std::array<uint64_t, marks_per_frame> ticks{};
+  if (vkGetQueryPoolResults(device_, query_pool_, slot * marks_per_frame,
+                            marks_per_frame, sizeof(ticks), ticks.data(),
+                            sizeof(uint64_t),
+                            VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+    return;
+  }
+  auto elapsed_ns = [&](GpuMark from, GpuMark to) {
+    uint64_t delta = (ticks[static_cast<uint32_t>(to)] -
+                      ticks[static_cast<uint32_t>(from)]) &
+                     timestamp_mask_;
+    return static_cast<uint64_t>(delta * timestamp_period_ns_);
+  };
+  uint64_t frame_ns = elapsed_ns(GpuMark::FrameBegin, GpuMark::FrameEnd);
+  uint64_t render_pass_ns =
+      elapsed_ns(GpuMark::RenderPassBegin, GpuMark::RenderPassEnd);
+  ++gpu_frames_;
+  gpu_frame_ns_ += frame_ns;
+  gpu_render_pass_ns_ += render_pass_ns;
+  if (keep_frame_times_) {
+    gpu_frame_times_ms_.push_back(frame_ns / 1e6);
+  }
+
+  // GPU and CPU clocks are not correlated, so GPU events are placed on the
+  // timeline as if the GPU started the frame when it was submitted.
+  uint64_t start_ns = query_slot.submit_ns;
+  emit({"gpu frame", query_slot.frame, start_ns, frame_ns, true});
+  emit({"render pass", query_slot.frame,
+        start_ns + elapsed_ns(GpuMark::FrameBegin, GpuMark::RenderPassBegin),
+        render_pass_ns, true});
+}
+
+void Profiler::collect_all() {
+  for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+    collect(slot);
+  }
+}
+
+uint64_t Profiler::now_ns() const {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - epoch_)
+      .count();
+}
+
+void Profiler::record_cpu(const char *name, uint64_t frame,
+                          uint64_t start_ns, uint64_t end_ns) {
+  emit({name, frame, start_ns, end_ns - start_ns, false});
+}
+
+Profiler::GpuStats Profiler::gpu_stats() const {
+  GpuStats stats;
+  stats.frames = gpu_frames_;
+  if (gpu_frames_ > 0) {
+    stats.frame_ms = gpu_frame_ns_ / 1e6 / gpu_frames_;
+    stats.render_pass_ms = gpu_render_pass_ns_ / 1e6 / gpu_frames_;
+  }
+  return stats;
+}
+
+void Profiler::reset_stats() {
+  gpu_frames_ = 0;
+  gpu_frame_ns_ = 0;
+  gpu_render_pass_ns_ = 0;
+  gpu_frame_times_ms_.clear();
+}
+
+void Profiler::emit(const ProfileEvent &event) {
+  if (!writer_.joinable()) {
+    return;
+  }
+  if (!events_.push(event)) {
+    ++dropped_events_;
+  }
+}
+
+void Profiler::writer_loop() {
+  ProfileEvent event;
+  for (;;) {
+    // Read the flag first so events pushed before stopping are drained.
+    bool stopping = stop_writer_;
+    while (events_.pop(event)) {
+      write_event(event);
+    }
+    if (stopping) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+}
+
+void Profiler::write_event(const ProfileEvent &event) {
+  // Complete ("X") events with microsecond timestamps.
+  trace_ << ",\n"
+         << R"({"name":")" << event.name << R"(","cat":")"
+         << (event.gpu ? "gpu" : "cpu") << R"(","ph":"X","ts":)"
+         << event.start_ns / 1000.0 << R"(,"dur":)"
+         << event.duration_ns / 1000.0 << R"(,"pid":)" << trace_pid
+         << R"(,"tid":)" << (event.gpu ? gpu_tid : cpu_tid)
+         << R"(,"args":{"frame":)" << event.frame << "}}";
+}
@@ -0,0 +1,189 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bounded single-producer single-consumer queue. push() and pop() never
+// block or allocate; push() fails when the ring is full.
+template <typename T, size_t Capacity> class SpscRing {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+public:
+  SpscRing() : slots_(Capacity) {}
+
+  bool push(const T &value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots_[head & (Capacity - 1)] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots_[tail & (Capacity - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::vector<T> slots_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+// Points in a frame's command buffer where a GPU timestamp is written.
+enum class GpuMark : uint32_t {
+  FrameBegin,
+  RenderPassBegin,
+  RenderPassEnd,
+  FrameEnd,
+  Count
+};
+
+// A finished measurement. Times are nanoseconds on the profiler's clock.
+struct ProfileEvent {
+  // Must point to a string literal.
+  const char *name;
+  uint64_t frame;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  bool gpu;
+};
+
+// Measures frame stages on the CPU with scoped timers and on the GPU with
+// one range of timestamp queries per frame in flight. When a trace file is
+// open, every measurement goes through a lock-free ring to a writer thread
+// that streams it out in Chrome trace event format (chrome://tracing,
+// Perfetto).
+//
+// Everything except the writer thread runs on the thread that draws frames,
+// which is the ring's only producer.
+class Profiler {
+public:
+  struct GpuStats {
+    uint64_t frames = 0;
+    double frame_ms = 0.0;
+    double render_pass_ms = 0.0;
+  };
+
+  Profiler() = default;
+  ~Profiler();
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  void init(VkPhysicalDevice physical_device, VkDevice device,
+            uint32_t queue_family);
+  // Stops the trace writer and closes the file. Queries must already have
+  // been destroyed.
+  void destroy();
+
+  // Starts streaming events to path. Throws when it cannot be opened.
+  void open_trace(const std::string &path);
+
+  void create_queries(uint32_t frames_in_flight);
+  void destroy_queries();
+
+  // GPU timing needs timestamp support on the graphics queue.
+  bool gpu_enabled() const { return gpu_enabled_; }
+
+  // Resets the slot's queries and writes FrameBegin. Must be recorded
+  // outside a render pass, first in the frame's command buffer.
+  void begin_commands(VkCommandBuffer command_buffer, uint32_t slot,
+                      uint64_t frame);
+  // Must be recorded outside a render pass.
+  void mark(VkCommandBuffer command_buffer, uint32_t slot, GpuMark mark);
+  // Call right after the slot's command buffer was submitted.
+  void submitted(uint32_t slot);
+  // Reads back the slot's last frame. Call once its fence has signalled.
+  void collect(uint32_t slot);
+  // Reads back every slot. Call while the device is idle.
+  void collect_all();
+
+  uint64_t now_ns() const;
+  void record_cpu(const char *name, uint64_t frame, uint64_t start_ns,
+                  uint64_t end_ns);
+
+  GpuStats gpu_stats() const;
+  void reset_stats();
+  // Also keep the GPU time of every collected frame, until reset_stats().
+  void keep_frame_times(bool keep) { keep_frame_times_ = keep; }
+  const std::vector<double> &gpu_frame_times_ms() const {
+    return gpu_frame_times_ms_;
+  }
+  uint64_t dropped_events() const { return dropped_events_; }
+
+private:
+  static constexpr uint32_t marks_per_frame =
+      static_cast<uint32_t>(GpuMark::Count);
+
+  struct QuerySlot {
+    bool pending = false;
+    uint64_t frame = 0;
+    uint64_t submit_ns = 0;
+  };
+
+  void emit(const ProfileEvent &event);
+  void writer_loop();
+  void write_event(const ProfileEvent &event);
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  bool gpu_enabled_ = false;
+  double timestamp_period_ns_ = 1.0;
+  uint64_t timestamp_mask_ = ~0ull;
+
+  VkQueryPool query_pool_ = VK_NULL_HANDLE;
+  std::vector<QuerySlot> slots_;
+
+  uint64_t gpu_frames_ = 0;
+  uint64_t gpu_frame_ns_ = 0;
+  uint64_t gpu_render_pass_ns_ = 0;
+  bool keep_frame_times_ = false;
+  std::vector<double> gpu_frame_times_ms_;
+
+  const std::chrono::steady_clock::time_point epoch_ =
+      std::chrono::steady_clock::now();
+
+  SpscRing<ProfileEvent, 1 << 14> events_;
+  uint64_t dropped_events_ = 0;
+  std::ofstream trace_;
+  std::thread writer_;
+  std::atomic<bool> stop_writer_{false};
+};
+
+// Records the wall-clock time between construction and destruction.
+class ProfileScope {
+public:
+  ProfileScope(Profiler &profiler, const char *name, uint64_t frame)
+      : profiler_{profiler}, name_{name}, frame_{frame},
+        start_ns_{profiler.now_ns()} {}
+  ~ProfileScope() {
+    profiler_.record_cpu(name_, frame_, start_ns_, profiler_.now_ns());
+  }
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+  Profiler &profiler_;
+  const char *name_;
+  uint64_t frame_;
+  uint64_t start_ns_;
+};
+
+#endif // PROFILER_H
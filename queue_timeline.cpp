@@ -0,0 +1,100 @@
+#include "queue_timeline.h"
+
+#include <stdexcept>
+
+void QueueTimeline::init(VkDevice device, VkQueue queue, uint32_t family) {
+  device_ = device;
+  queue_ = queue;
+  family_ = family;
+  last_submitted_ = 0;
+  completed_ = 0;
+
+  VkSemaphoreTypeCreateInfo typeInfo{};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphoreInfo{};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+  if (vkCreateSemaphore(device_, &semaphoreInfo, nullptr, &semaphore_) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create timeline semaphore!"};
+  }
+}
+
+void QueueTimeline::destroy() {
+  wait_idle();
+  vkDestroySemaphore(device_, semaphore_, nullptr);
+  semaphore_ = VK_NULL_HANDLE;
+}
+
+uint64_t
+QueueTimeline::submit(const std::vector<VkCommandBuffer> &command_buffers,
+                      const std::vector<Wait> &waits, VkSemaphore signal) {
+  wait_semaphores_.clear();
+  wait_values_.clear();
+  wait_stages_.clear();
+  for (const auto &wait : waits) {
+    wait_semaphores_.push_back(wait.semaphore);
+    wait_values_.push_back(wait.value);
+    wait_stages_.push_back(wait.stage);
+  }
+  uint64_t value = last_submitted_ + 1;
+  VkSemaphore signals[] = {semaphore_, signal};
+  // The binary semaphore's value is ignored.
+  uint64_t signal_values[] = {value, 0};
+  uint32_t signal_count = signal != VK_NULL_HANDLE ? 2 : 1;
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount =
+      static_cast<uint32_t>(wait_values_.size());
+  timelineInfo.pWaitSemaphoreValues = wait_values_.data();
+  timelineInfo.signalSemaphoreValueCount = signal_count;
+  timelineInfo.pSignalSemaphoreValues = signal_values;
+
+  VkSubmitInfo submitInfo{};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount =
+      static_cast<uint32_t>(wait_semaphores_.size());
+  submitInfo.pWaitSemaphores = wait_semaphores_.data();
+  submitInfo.pWaitDstStageMask = wait_stages_.data();
+  submitInfo.commandBufferCount =
+      static_cast<uint32_t>(command_buffers.size());
+  submitInfo.pCommandBuffers = command_buffers.data();
+  submitInfo.signalSemaphoreCount = signal_count;
+  submitInfo.pSignalSemaphores = signals;
+  if (vkQueueSubmit(queue_, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to submit to queue!"};
+  }
+  last_submitted_ = value;
+  return value;
+}
+
+bool QueueTimeline::is_complete(uint64_t value) {
+  if (value <= completed_) {
+    return true;
+  }
+  if (vkGetSemaphoreCounterValue(device_, semaphore_, &completed_) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to read timeline semaphore!"};
+  }
+  return value <= completed_;
+}
+
+void QueueTimeline::wait(uint64_t value) {
+  if (is_complete(value)) {
+    return;
+  }
+  VkSemaphoreWaitInfo waitInfo{};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &semaphore_;
+  waitInfo.pValues = &value;
+  if (vkWaitSemaphores(device_, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to wait for timeline semaphore!"};
+  }
+  completed_ = value;
+}
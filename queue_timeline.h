@@ -0,0 +1,68 @@
+#ifndef QUEUE_TIMELINE_H
+#define QUEUE_TIMELINE_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+// A queue and a timeline semaphore counting its submissions. Every
+// submit() signals the next value, so whether some piece of work has
+// finished is a comparison against one counter instead of a fence per
+// submission, and other queues wait on the same semaphore at that value.
+class QueueTimeline {
+public:
+  // One semaphore wait of a submission. value is ignored for binary
+  // semaphores, which the swapchain still needs.
+  struct Wait {
+    VkSemaphore semaphore;
+    uint64_t value;
+    VkPipelineStageFlags stage;
+  };
+
+  QueueTimeline() = default;
+  QueueTimeline(const QueueTimeline &) = delete;
+  QueueTimeline &operator=(const QueueTimeline &) = delete;
+
+  void init(VkDevice device, VkQueue queue, uint32_t family);
+  // Waits for everything submitted and destroys the semaphore.
+  void destroy();
+
+  VkQueue queue() const { return queue_; }
+  uint32_t family() const { return family_; }
+  VkSemaphore semaphore() const { return semaphore_; }
+
+  // Submits command_buffers after waits and returns the timeline value that
+  // signals once they complete. signal is an optional binary semaphore
+  // signalled at the same time, for presentation.
+  uint64_t submit(const std::vector<VkCommandBuffer> &command_buffers,
+                  const std::vector<Wait> &waits = {},
+                  VkSemaphore signal = VK_NULL_HANDLE);
+  // Value of the latest submission, 0 before the first one.
+  uint64_t last_submitted() const { return last_submitted_; }
+  // Queries the device only when value is not known to be complete yet.
+  bool is_complete(uint64_t value);
+  // Blocks until value has been signalled.
+  void wait(uint64_t value);
+  void wait_idle() { wait(last_submitted_); }
+  // A wait for value, for a submission to another queue.
+  Wait wait_for(uint64_t value, VkPipelineStageFlags stage) const {
+    return {semaphore_, value, stage};
+  }
+
+private:
+  VkDevice device_ = VK_NULL_HANDLE;
+  VkQueue queue_ = VK_NULL_HANDLE;
+  uint32_t family_ = 0;
+  VkSemaphore semaphore_ = VK_NULL_HANDLE;
+  uint64_t last_submitted_ = 0;
+  // Highest value seen signalled.
+  uint64_t completed_ = 0;
+
+  // Reused by submit() to avoid allocating per submission.
+  std::vector<VkSemaphore> wait_semaphores_;
+  std::vector<uint64_t> wait_values_;
+  std::vector<VkPipelineStageFlags> wait_stages_;
+};
+
+#endif // QUEUE_TIMELINE_H
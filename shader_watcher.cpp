@@ -0,0 +1,169 @@
+#include "shader_watcher.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <cerrno>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+namespace {
+
+// Editors often save in several steps; changes closer together than this
+// are compiled once.
+constexpr auto settle_time = std::chrono::milliseconds{50};
+constexpr int poll_timeout_ms = 100;
+
+// Runs args[0], looked up in PATH unless it is a path, and waits for it.
+// No shell is involved, so arguments need no quoting. Returns whether it
+// exited with status 0.
+bool run_process(const std::vector<std::string> &args) {
+#ifdef __linux__
+  std::vector<char *> argv;
+  for (const auto &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) !=
+      0) {
+    return false;
+  }
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+  (void)args;
+  return false;
+#endif
+}
+
+} // namespace
+
+ShaderWatcher::ShaderWatcher(std::filesystem::path source_dir,
+                             std::string glslc, Bundle initial)
+    : source_dir_{std::move(source_dir)}, glslc_{std::move(glslc)},
+      bundle_{std::move(initial)} {
+#ifdef __linux__
+  output_dir_ = std::filesystem::temp_directory_path() /
+                ("triangle_shaders_" + std::to_string(getpid()));
+  std::filesystem::create_directories(output_dir_);
+
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0 ||
+      inotify_add_watch(inotify_fd_, source_dir_.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    if (inotify_fd_ >= 0) {
+      close(inotify_fd_);
+    }
+    throw std::runtime_error{"Failed to watch " + source_dir_.string() + "!"};
+  }
+  thread_ = std::thread{[this] { watch_loop(); }};
+#else
+  throw std::runtime_error{"Shader hot reload needs inotify (Linux)!"};
+#endif
+}
+
+ShaderWatcher::~ShaderWatcher() {
+  stop_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+#ifdef __linux__
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+#endif
+  std::error_code ignored;
+  std::filesystem::remove_all(output_dir_, ignored);
+}
+
+std::optional<ShaderWatcher::Bundle> ShaderWatcher::take_update() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (!updated_) {
+    return std::nullopt;
+  }
+  updated_ = false;
+  return bundle_;
+}
+
+void ShaderWatcher::watch_loop() {
+#ifdef __linux__
+  alignas(inotify_event) char buffer[4096];
+  std::set<std::string> changed;
+  auto last_change = std::chrono::steady_clock::now();
+  while (!stop_) {
+    pollfd fd{inotify_fd_, POLLIN, 0};
+    if (poll(&fd, 1, poll_timeout_ms) > 0) {
+      ssize_t length;
+      while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length;) {
+          auto *event = reinterpret_cast<inotify_event *>(p);
+          if (event->len > 0 && bundle_.count(event->name) != 0) {
+            changed.insert(event->name);
+            last_change = std::chrono::steady_clock::now();
+          }
+          p += sizeof(inotify_event) + event->len;
+        }
+      }
+    }
+    if (changed.empty() ||
+        std::chrono::steady_clock::now() - last_change < settle_time) {
+      continue;
+    }
+    bool any = false;
+    for (const auto &name : changed) {
+      any |= compile(name);
+    }
+    changed.clear();
+    if (any) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      updated_ = true;
+    }
+  }
+#endif
+}
+
+bool ShaderWatcher::compile(const std::string &name) {
+  std::filesystem::path output = output_dir_ / (name + ".spv");
+  auto start = std::chrono::steady_clock::now();
+  if (!run_process(
+          {glslc_, (source_dir_ / name).string(), "-o", output.string()})) {
+    std::cerr << "Failed to compile " << name << ", keeping the previous build"
+              << std::endl;
+    return false;
+  }
+
+  std::ifstream file{output, std::ios::ate | std::ios::binary};
+  size_t size = file ? static_cast<size_t>(file.tellg()) : 0;
+  if (size == 0 || size % sizeof(uint32_t) != 0) {
+    std::cerr << "Invalid SPIR-V for " << name << std::endl;
+    return false;
+  }
+  std::vector<uint32_t> words(size / sizeof(uint32_t));
+  file.seekg(0);
+  file.read(reinterpret_cast<char *>(words.data()), size);
+
+  std::cout << "Recompiled " << name << " in "
+            << std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << " ms" << std::endl;
+  std::lock_guard<std::mutex> lock{mutex_};
+  bundle_[name] = std::move(words);
+  return true;
+}
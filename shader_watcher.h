@@ -0,0 +1,53 @@
+#ifndef SHADER_WATCHER_H
+#define SHADER_WATCHER_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Development aid: watches a shader source directory with inotify and
+// recompiles changed shaders with glslc on a background thread. Successful
+// builds are collected with take_update(); a shader that fails to compile
+// keeps its last good SPIR-V and the error is printed by glslc.
+class ShaderWatcher {
+public:
+  // SPIR-V of every watched shader, keyed by source file name.
+  using Bundle = std::map<std::string, std::vector<uint32_t>>;
+
+  // initial holds the SPIR-V the program started with, its keys name the
+  // files to watch.
+  ShaderWatcher(std::filesystem::path source_dir, std::string glslc,
+                Bundle initial);
+  ~ShaderWatcher();
+  ShaderWatcher(const ShaderWatcher &) = delete;
+  ShaderWatcher &operator=(const ShaderWatcher &) = delete;
+
+  // Returns the full bundle if any shader was rebuilt since the last call.
+  std::optional<Bundle> take_update();
+
+private:
+  void watch_loop();
+  // Runs glslc on name. Returns false and leaves the bundle alone when
+  // compilation fails.
+  bool compile(const std::string &name);
+
+  std::filesystem::path source_dir_;
+  std::filesystem::path output_dir_;
+  std::string glslc_;
+  int inotify_fd_ = -1;
+
+  std::mutex mutex_;
+  Bundle bundle_;
+  bool updated_ = false;
+
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+#endif // SHADER_WATCHER_H
@@ -0,0 +1,25 @@
+#version 450
+
+// Device benchmark geometry, generated from gl_VertexIndex alone. Fill mode
+// draws one triangle covering the whole target per instance; triangle mode
+// draws half-pixel triangles on a grid of target-sized cells.
+layout(push_constant) uniform Params {
+    uint mode;
+    // Width and height of the target in pixels.
+    uint size;
+} params;
+
+const uint mode_fill = 0u;
+
+void main(){
+    uint index = uint(gl_VertexIndex);
+    uint corner = index % 3u;
+    vec2 offset = vec2(corner == 1u ? 1.0 : 0.0, corner == 2u ? 1.0 : 0.0);
+    if (params.mode == mode_fill) {
+        gl_Position = vec4(offset * 4.0 - 1.0, 0.0, 1.0);
+        return;
+    }
+    uint cell = (index / 3u) % (params.size * params.size);
+    vec2 pixel = vec2(cell % params.size, cell / params.size) + offset;
+    gl_Position = vec4(pixel / float(params.size) * 2.0 - 1.0, 0.0, 1.0);
+}
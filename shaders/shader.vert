@@ -1,21 +1,26 @@
 #version 450
 
-layout(location = 0) out vec3 fragColor;
-
-vec2 positions[3] = vec2[](
-    vec2(0.0,-0.5),
-    vec2(0.5,0.5),
-    vec2(-0.5,0.5)
-);
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+// xy offset, scale, rotation
+layout(location = 2) in vec4 instanceTransform;
+// rgb color, w distance from the viewer in [0, 1)
+layout(location = 3) in vec4 instanceColor;
 
-vec3 colors[3] = vec3[](
-    vec3(1.0,0.0,0.0),
-    vec3(0.0,1.0,0.0),
-    vec3(0.0,0.0,1.0)
-);
+layout(set = 0, binding = 0) uniform View {
+    // xy offset and scale applied after the instance transform
+    vec4 camera;
+} view;
 
+layout(location = 0) out vec3 fragColor;
 
 void main(){
-    gl_Position = vec4(positions[gl_VertexIndex],0.0,1.0);
-    fragColor = colors[gl_VertexIndex];
+    float s = sin(instanceTransform.w);
+    float c = cos(instanceTransform.w);
+    vec2 rotated = mat2(c, s, -s, c) * inPosition;
+    vec2 position = rotated * instanceTransform.z + instanceTransform.xy;
+    // Reverse-Z: the nearest instances get the largest depth.
+    gl_Position = vec4(position * view.camera.z + view.camera.xy,
+                       1.0 - instanceColor.w, 1.0);
+    fragColor = inColor * instanceColor.rgb;
 }
\ No newline at end of file
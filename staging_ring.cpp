@@ -0,0 +1,266 @@
+#include "staging_ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+namespace {
+
+// Offsets inside the ring are kept aligned for any copy source.
+constexpr VkDeviceSize ring_alignment = 16;
+
+// Everything that may consume uploaded data.
+constexpr VkAccessFlags upload_dst_access =
+    VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+    VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT |
+    VK_ACCESS_SHADER_READ_BIT;
+constexpr VkPipelineStageFlags upload_dst_stages =
+    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+} // namespace
+
+void StagingRing::init(VkDevice device, GpuAllocator &allocator,
+                       QueueTimeline &timeline, uint32_t dst_queue_family,
+                       VkDeviceSize capacity) {
+  device_ = device;
+  allocator_ = &allocator;
+  timeline_ = &timeline;
+  dst_family_ = dst_queue_family;
+  capacity_ = capacity;
+  head_ = 0;
+  used_ = 0;
+  pending_bytes_ = 0;
+
+  VkCommandPoolCreateInfo poolInfo{};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                   VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = timeline.family();
+  if (vkCreateCommandPool(device_, &poolInfo, nullptr, &command_pool_) !=
+      VK_SUCCESS) {
+    throw std::runtime_error{"Failed to create staging command pool!"};
+  }
+
+  memory_ = allocator.create_buffer(
+      capacity_, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      0, buffer_);
+}
+
+void StagingRing::destroy() {
+  wait_idle();
+  free_batches_.clear();
+  handoff_buffers_.clear();
+  vkDestroyCommandPool(device_, command_pool_, nullptr);
+  allocator_->destroy_buffer(buffer_, memory_);
+}
+
+void StagingRing::upload(VkBuffer dst, VkDeviceSize dst_offset,
+                         const void *data, VkDeviceSize size) {
+  // Large uploads go through in pieces so they never need the whole ring.
+  const VkDeviceSize max_chunk = capacity_ / 2;
+  const auto *bytes = static_cast<const char *>(data);
+  uploading_ = dst;
+  while (size > 0) {
+    VkDeviceSize chunk = std::min(size, max_chunk);
+    VkDeviceSize offset = reserve(chunk);
+    std::memcpy(static_cast<char *>(memory_.mapped) + offset, bytes, chunk);
+
+    PendingCopy copy{};
+    copy.dst = dst;
+    copy.region.srcOffset = offset;
+    copy.region.dstOffset = dst_offset;
+    copy.region.size = chunk;
+    pending_.push_back(copy);
+
+    bytes += chunk;
+    dst_offset += chunk;
+    size -= chunk;
+  }
+  uploading_ = VK_NULL_HANDLE;
+}
+
+VkDeviceSize StagingRing::reserve(VkDeviceSize size) {
+  for (;;) {
+    VkDeviceSize offset =
+        (head_ + ring_alignment - 1) / ring_alignment * ring_alignment;
+    VkDeviceSize required = offset - head_ + size;
+    if (offset + size > capacity_) {
+      // Skip the end of the ring, it is released together with this upload.
+      offset = 0;
+      required = capacity_ - head_ + size;
+    }
+    if (used_ + required <= capacity_) {
+      head_ = offset + size;
+      used_ += required;
+      pending_bytes_ += required;
+      return offset;
+    }
+
+    if (!pending_.empty()) {
+      flush();
+    }
+    if (in_flight_.empty()) {
+      throw std::runtime_error{"Staging ring too small for upload!"};
+    }
+    retire(true);
+  }
+}
+
+void StagingRing::flush() {
+  if (pending_.empty()) {
+    return;
+  }
+  retire(false);
+
+  Batch batch{};
+  if (!free_batches_.empty()) {
+    batch = free_batches_.back();
+    free_batches_.pop_back();
+    vkResetCommandBuffer(batch.command_buffer, 0);
+  } else {
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = command_pool_;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    if (vkAllocateCommandBuffers(device_, &allocInfo, &batch.command_buffer) !=
+        VK_SUCCESS) {
+      throw std::runtime_error{"Failed to allocate staging command buffer!"};
+    }
+  }
+
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  if (vkBeginCommandBuffer(batch.command_buffer, &beginInfo) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to begin staging command buffer!"};
+  }
+
+  // One vkCmdCopyBuffer per destination, with all of its regions.
+  std::map<VkBuffer, std::vector<VkBufferCopy>> regions;
+  for (const auto &copy : pending_) {
+    regions[copy.dst].push_back(copy.region);
+  }
+  for (const auto &[dst, dst_regions] : regions) {
+    vkCmdCopyBuffer(batch.command_buffer, buffer_, dst,
+                    static_cast<uint32_t>(dst_regions.size()),
+                    dst_regions.data());
+  }
+
+  bool released = false;
+  if (transfers_ownership()) {
+    // Release half of the ownership transfer; acquire() records the other.
+    std::vector<VkBufferMemoryBarrier> releases;
+    for (const auto &[dst, dst_regions] : regions) {
+      if (dst == uploading_) {
+        // Released with its last chunk, by a later batch.
+        continue;
+      }
+      VkBufferMemoryBarrier release{};
+      release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      release.dstAccessMask = 0;
+      release.srcQueueFamilyIndex = timeline_->family();
+      release.dstQueueFamilyIndex = dst_family_;
+      release.buffer = dst;
+      release.offset = 0;
+      release.size = VK_WHOLE_SIZE;
+      releases.push_back(release);
+      handoff_buffers_.push_back(dst);
+    }
+    released = !releases.empty();
+    if (released) {
+      vkCmdPipelineBarrier(
+          batch.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+          static_cast<uint32_t>(releases.size()), releases.data(), 0, nullptr);
+    }
+  } else {
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = upload_dst_access;
+    vkCmdPipelineBarrier(batch.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         upload_dst_stages, 0, 1, &barrier, 0, nullptr, 0,
+                         nullptr);
+  }
+
+  if (vkEndCommandBuffer(batch.command_buffer) != VK_SUCCESS) {
+    throw std::runtime_error{"Failed to record staging command buffer!"};
+  }
+
+  batch.value = timeline_->submit({batch.command_buffer});
+  if (released) {
+    handoff_value_ = batch.value;
+  }
+
+  batch.bytes = pending_bytes_;
+  pending_bytes_ = 0;
+  pending_.clear();
+  in_flight_.push_back(batch);
+}
+
+void StagingRing::retire(bool wait) {
+  while (!in_flight_.empty()) {
+    Batch &batch = in_flight_.front();
+    if (wait) {
+      timeline_->wait(batch.value);
+      wait = false;
+    } else if (!timeline_->is_complete(batch.value)) {
+      break;
+    }
+    used_ -= batch.bytes;
+    free_batches_.push_back(batch);
+    in_flight_.pop_front();
+  }
+  if (in_flight_.empty() && pending_.empty()) {
+    // Nothing references the ring, start over at the beginning.
+    head_ = 0;
+    used_ = 0;
+  }
+}
+
+void StagingRing::wait_idle() {
+  flush();
+  while (!in_flight_.empty()) {
+    retire(true);
+  }
+}
+
+void StagingRing::acquire(VkCommandBuffer command_buffer,
+                          std::vector<QueueTimeline::Wait> &waits) {
+  if (handoff_buffers_.empty()) {
+    return;
+  }
+  // A buffer uploaded by several batches since the last call is acquired
+  // once; the latest release is the one that matters.
+  std::sort(handoff_buffers_.begin(), handoff_buffers_.end());
+  handoff_buffers_.erase(
+      std::unique(handoff_buffers_.begin(), handoff_buffers_.end()),
+      handoff_buffers_.end());
+  std::vector<VkBufferMemoryBarrier> acquires;
+  for (VkBuffer buffer : handoff_buffers_) {
+    VkBufferMemoryBarrier acquire{};
+    acquire.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    acquire.srcAccessMask = 0;
+    acquire.dstAccessMask = upload_dst_access;
+    acquire.srcQueueFamilyIndex = timeline_->family();
+    acquire.dstQueueFamilyIndex = dst_family_;
+    acquire.buffer = buffer;
+    acquire.offset = 0;
+    acquire.size = VK_WHOLE_SIZE;
+    acquires.push_back(acquire);
+  }
+  handoff_buffers_.clear();
+  // Waiting for the latest batch covers every earlier one.
+  waits.push_back(timeline_->wait_for(handoff_value_, upload_dst_stages));
+  // The source stages match the semaphore wait, so the acquire happens
+  // after the copies.
+  vkCmdPipelineBarrier(command_buffer, upload_dst_stages, upload_dst_stages, 0,
+                       0, nullptr, static_cast<uint32_t>(acquires.size()),
+                       acquires.data(), 0, nullptr);
+}
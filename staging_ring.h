@@ -0,0 +1,111 @@
+#ifndef STAGING_RING_H
+#define STAGING_RING_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "gpu_allocator.h"
+#include "queue_timeline.h"
+
+// Uploads data into device-local buffers through one persistently mapped
+// host-visible ring. upload() only copies into the ring; flush() records
+// every queued copy into a single command buffer, so many small uploads
+// cost one submission. Ring space is reclaimed as the timeline values of
+// submitted batches are reached.
+//
+// The copies may run on a dedicated transfer queue. Uploaded buffers are
+// then released to the destination queue family at the end of each batch,
+// and the destination side picks them up with acquire().
+class StagingRing {
+public:
+  StagingRing() = default;
+  StagingRing(const StagingRing &) = delete;
+  StagingRing &operator=(const StagingRing &) = delete;
+
+  // Copies are submitted to timeline's queue; the buffers are used by
+  // dst_queue_family afterwards.
+  void init(VkDevice device, GpuAllocator &allocator, QueueTimeline &timeline,
+            uint32_t dst_queue_family, VkDeviceSize capacity);
+  // Waits for outstanding uploads and releases everything.
+  void destroy();
+
+  // Queues a copy of size bytes into dst at dst_offset. The data is
+  // visible to vertex input, shaders and indirect draws of any submission
+  // made to the same queue after the next flush(), or after acquire() when
+  // the copies run on another queue family. In that case dst is released
+  // to that family only by the batch holding the upload's last chunk, so an
+  // upload larger than the ring stays on the transfer queue until it is
+  // complete. The transfer queue takes dst over without an ownership
+  // transfer, so dst must not hold data that outlives the upload, and
+  // anything uploaded into it before is lost.
+  void upload(VkBuffer dst, VkDeviceSize dst_offset, const void *data,
+              VkDeviceSize size);
+  // Submits all queued copies. Does nothing when nothing is queued.
+  void flush();
+  // Flushes and blocks until every upload has completed.
+  void wait_idle();
+
+  // Records the acquire half of the ownership transfer of everything
+  // flushed since the last call into command_buffer, which must belong to
+  // dst_queue_family, and adds the timeline wait its submission needs. Does
+  // nothing when the copies run on dst_queue_family.
+  void acquire(VkCommandBuffer command_buffer,
+               std::vector<QueueTimeline::Wait> &waits);
+
+private:
+  struct PendingCopy {
+    VkBuffer dst;
+    VkBufferCopy region;
+  };
+  struct Batch {
+    VkCommandBuffer command_buffer;
+    // Timeline value signalled when the copies are done.
+    uint64_t value;
+    // Ring bytes, including wrap-around padding, released when done.
+    VkDeviceSize bytes;
+  };
+
+  // Returns the ring offset of size free bytes, waiting for old batches if
+  // the ring is full.
+  VkDeviceSize reserve(VkDeviceSize size);
+  // Releases finished batches, waiting for the oldest one when wait is set.
+  void retire(bool wait);
+  bool transfers_ownership() const {
+    return timeline_->family() != dst_family_;
+  }
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  QueueTimeline *timeline_ = nullptr;
+  uint32_t dst_family_ = 0;
+  VkCommandPool command_pool_ = VK_NULL_HANDLE;
+
+  VkBuffer buffer_ = VK_NULL_HANDLE;
+  GpuAllocation memory_;
+  VkDeviceSize capacity_ = 0;
+  VkDeviceSize head_ = 0;
+  // Bytes between the oldest unreleased upload and head_.
+  VkDeviceSize used_ = 0;
+  // Bytes reserved since the last flush.
+  VkDeviceSize pending_bytes_ = 0;
+
+  std::vector<PendingCopy> pending_;
+  // Destination of the upload() in progress. A flush in the middle of it
+  // keeps the buffer on the transfer queue; releasing it there would make
+  // the chunks already copied undefined once the next ones are written.
+  VkBuffer uploading_ = VK_NULL_HANDLE;
+  std::deque<Batch> in_flight_;
+  // Finished batches kept for reuse.
+  std::vector<Batch> free_batches_;
+
+  // Buffers released by flushed batches and not yet acquired by the
+  // destination queue, and the timeline value of the latest such batch.
+  // May hold a buffer once per batch that wrote it.
+  std::vector<VkBuffer> handoff_buffers_;
+  uint64_t handoff_value_ = 0;
+};
+
+#endif // STAGING_RING_H
@@ -0,0 +1,127 @@
+#include "startup_scheduler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+// Buffers of the stage running on this thread, if it was started.
+thread_local std::ostream *stage_out = nullptr;
+thread_local std::ostream *stage_err = nullptr;
+
+// Points this thread's stage streams at a stage's buffers while it runs.
+// std::async may reuse threads, so they are reset even when it throws.
+class StageStreams {
+public:
+  StageStreams(std::ostream &out, std::ostream &err) {
+    stage_out = &out;
+    stage_err = &err;
+  }
+  ~StageStreams() {
+    stage_out = nullptr;
+    stage_err = nullptr;
+  }
+  StageStreams(const StageStreams &) = delete;
+  StageStreams &operator=(const StageStreams &) = delete;
+};
+
+} // namespace
+
+StartupScheduler::StartupScheduler()
+    : origin_(std::chrono::steady_clock::now()) {}
+
+void StartupScheduler::run(const std::string &name,
+                           const std::function<void()> &work) {
+  double start_ms = elapsed_ms();
+  work();
+  record(name, false, start_ms);
+}
+
+void StartupScheduler::start(const std::string &name,
+                             std::function<void()> work) {
+  if (running_.count(name) != 0) {
+    throw std::runtime_error{"Startup stage " + name + " already running!"};
+  }
+  auto output = std::make_shared<Output>();
+  running_[name] = {
+      std::async(std::launch::async,
+                 [this, name, output, work = std::move(work)] {
+                   StageStreams streams{output->out, output->err};
+                   double start_ms = elapsed_ms();
+                   work();
+                   record(name, true, start_ms);
+                 }),
+      output};
+}
+
+void StartupScheduler::join(const std::string &name) {
+  auto it = running_.find(name);
+  if (it == running_.end()) {
+    throw std::runtime_error{"Startup stage " + name + " was not started!"};
+  }
+  Running stage = std::move(it->second);
+  running_.erase(it);
+  stage.done.wait();
+  std::cout << stage.output->out.str() << std::flush;
+  std::cerr << stage.output->err.str() << std::flush;
+  stage.done.get();
+}
+
+std::ostream &StartupScheduler::out() {
+  return stage_out != nullptr ? *stage_out : std::cout;
+}
+
+std::ostream &StartupScheduler::err() {
+  return stage_err != nullptr ? *stage_err : std::cerr;
+}
+
+void StartupScheduler::first_frame() {
+  if (!finished()) {
+    first_frame_ms_ = elapsed_ms();
+  }
+}
+
+void StartupScheduler::print(std::ostream &out) const {
+  std::vector<Stage> stages;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stages = stages_;
+  }
+  std::sort(stages.begin(), stages.end(),
+            [](const Stage &a, const Stage &b) {
+              return a.start_ms < b.start_ms;
+            });
+
+  size_t name_width = 5;
+  for (const Stage &stage : stages) {
+    name_width = std::max(name_width, stage.name.size());
+  }
+  out << std::left << std::setw(static_cast<int>(name_width))
+      << "stage" << std::right << " | start ms | duration ms | thread\n";
+  for (const Stage &stage : stages) {
+    out << std::left << std::setw(static_cast<int>(name_width))
+        << stage.name << std::right << std::fixed << std::setprecision(3)
+        << " | " << std::setw(8) << stage.start_ms << " | " << std::setw(11)
+        << stage.end_ms - stage.start_ms << " | "
+        << (stage.background ? "background" : "main") << "\n";
+  }
+  if (finished()) {
+    out << std::fixed << std::setprecision(3)
+        << "Time to first frame: " << first_frame_ms_ << " ms" << std::endl;
+  }
+}
+
+double StartupScheduler::elapsed_ms() const {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - origin_)
+      .count();
+}
+
+void StartupScheduler::record(const std::string &name, bool background,
+                              double start_ms) {
+  double end_ms = elapsed_ms();
+  std::lock_guard<std::mutex> lock{mutex_};
+  stages_.push_back({name, background, start_ms, end_ms});
+}
@@ -0,0 +1,76 @@
+#ifndef STARTUP_SCHEDULER_H
+#define STARTUP_SCHEDULER_H
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Runs the startup sequence as named stages and records when each one
+// started and finished. Stages with no dependency on what the main thread
+// is doing can be started on their own thread and joined later, so the
+// slow parts of startup overlap. Times are measured from construction.
+class StartupScheduler {
+public:
+  StartupScheduler();
+  StartupScheduler(const StartupScheduler &) = delete;
+  StartupScheduler &operator=(const StartupScheduler &) = delete;
+
+  // Runs work on the calling thread.
+  void run(const std::string &name, const std::function<void()> &work);
+  // Runs work on a new thread. It must be joined before anything that
+  // depends on it, and before the state it touches goes away.
+  void start(const std::string &name, std::function<void()> work);
+  // Waits for a started stage, prints what it wrote to out() and err(),
+  // and rethrows what it threw.
+  void join(const std::string &name);
+
+  // Where stages write messages. A stage running on its own thread writes
+  // into buffers that join() prints, so its output never interleaves with
+  // the main thread's; anywhere else these are std::cout and std::cerr.
+  static std::ostream &out();
+  static std::ostream &err();
+
+  // Records the first submitted frame, which ends startup. Only the first
+  // call counts.
+  void first_frame();
+  bool finished() const { return first_frame_ms_ >= 0.0; }
+  double first_frame_ms() const { return first_frame_ms_; }
+
+  // Prints every stage in start order and the time to the first frame.
+  void print(std::ostream &out) const;
+
+private:
+  struct Stage {
+    std::string name;
+    bool background;
+    double start_ms;
+    double end_ms;
+  };
+
+  struct Output {
+    std::ostringstream out;
+    std::ostringstream err;
+  };
+  struct Running {
+    std::future<void> done;
+    std::shared_ptr<Output> output;
+  };
+
+  double elapsed_ms() const;
+  void record(const std::string &name, bool background, double start_ms);
+
+  std::chrono::steady_clock::time_point origin_;
+  mutable std::mutex mutex_;
+  std::vector<Stage> stages_;
+  std::unordered_map<std::string, Running> running_;
+  double first_frame_ms_ = -1.0;
+};
+
+#endif // STARTUP_SCHEDULER_H
@@ -0,0 +1,130 @@
+#include "gpu_allocator.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition "\n";        \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (false)
+
+void test_split() {
+  BuddyBlock block{1024, 64};
+  CHECK(block.largest_free() == 1024);
+
+  // The first allocation splits the block down to the smallest node and
+  // keeps the lower halves.
+  CHECK(block.allocate(64) == VkDeviceSize{0});
+  CHECK(block.allocate(64) == VkDeviceSize{64});
+  CHECK(block.allocate(128) == VkDeviceSize{128});
+  CHECK(block.allocate(256) == VkDeviceSize{256});
+  CHECK(block.used() == 512);
+  CHECK(block.largest_free() == 512);
+}
+
+void test_rounding() {
+  BuddyBlock block{1024, 64};
+  // Sizes round up to the next power of two, never below the minimum.
+  CHECK(block.allocate(1) == VkDeviceSize{0});
+  CHECK(block.used() == 64);
+  CHECK(block.allocate(65) == VkDeviceSize{128});
+  CHECK(block.used() == 64 + 128);
+  CHECK(block.free(128) == 128);
+  CHECK(block.free(0) == 64);
+}
+
+void test_merge() {
+  BuddyBlock block{1024, 64};
+  std::vector<VkDeviceSize> offsets;
+  for (int i = 0; i < 16; ++i) {
+    auto offset = block.allocate(64);
+    CHECK(offset.has_value());
+    if (offset) {
+      offsets.push_back(*offset);
+    }
+  }
+  CHECK(!block.allocate(64));
+  CHECK(block.largest_free() == 0);
+
+  // Freeing one of two buddies must not merge, freeing both must.
+  CHECK(block.free(64) == 64);
+  CHECK(block.largest_free() == 64);
+  CHECK(block.free(0) == 64);
+  CHECK(block.largest_free() == 128);
+  CHECK(block.allocate(128) == VkDeviceSize{0});
+  CHECK(block.free(0) == 128);
+
+  for (VkDeviceSize offset : offsets) {
+    if (offset != 0 && offset != 64) {
+      block.free(offset);
+    }
+  }
+  CHECK(block.empty());
+  CHECK(block.largest_free() == 1024);
+  CHECK(block.allocate(1024) == VkDeviceSize{0});
+}
+
+void test_alignment() {
+  BuddyBlock block{1 << 20, 256};
+  std::vector<VkDeviceSize> sizes = {256, 4096, 300, 65536, 1000, 512, 8192};
+  for (VkDeviceSize size : sizes) {
+    auto offset = block.allocate(size);
+    CHECK(offset.has_value());
+    if (!offset) {
+      continue;
+    }
+    VkDeviceSize node_size = 256;
+    while (node_size < size) {
+      node_size *= 2;
+    }
+    CHECK(*offset % node_size == 0);
+    CHECK(*offset + node_size <= block.size());
+  }
+}
+
+void test_out_of_space() {
+  BuddyBlock block{1024, 64};
+  CHECK(!block.allocate(2048));
+  CHECK(block.allocate(512) == VkDeviceSize{0});
+  CHECK(!block.allocate(1024));
+  CHECK(block.allocate(512) == VkDeviceSize{512});
+  CHECK(!block.allocate(64));
+}
+
+void test_bad_free() {
+  BuddyBlock block{1024, 64};
+  block.allocate(64);
+  bool threw = false;
+  try {
+    block.free(64);
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  CHECK(block.used() == 64);
+}
+
+} // namespace
+
+int main() {
+  test_split();
+  test_rounding();
+  test_merge();
+  test_alignment();
+  test_out_of_space();
+  test_bad_free();
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+#include "bench_stats.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition "\n";        \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (false)
+
+bool near(double value, double expected, double tolerance) {
+  return std::abs(value - expected) <= tolerance;
+}
+
+// Example 1 of the Wikipedia article on Welch's t-test. The reference p was
+// computed by integrating the Student's t density numerically.
+void test_reference() {
+  std::vector<double> a = {27.5, 21.0, 19.0, 23.6, 17.0, 17.9, 16.9, 20.1,
+                           21.9, 22.6, 23.1, 19.6, 19.0, 21.7, 21.4};
+  std::vector<double> b = {27.1, 22.0, 20.8, 23.4, 23.4, 23.5, 25.8, 22.0,
+                           24.8, 20.2, 21.9, 22.1, 22.9, 20.5, 24.4};
+  WelchResult result = welch_test(summarize(a), summarize(b));
+  CHECK(near(result.t, 2.455356398286006, 1e-9));
+  CHECK(near(result.df, 24.98852929023142, 1e-9));
+  CHECK(near(result.p, 0.02137800146286184, 1e-9));
+
+  // Swapping the samples flips the sign of t only.
+  WelchResult swapped = welch_test(summarize(b), summarize(a));
+  CHECK(near(swapped.t, -result.t, 1e-12));
+  CHECK(near(swapped.df, result.df, 1e-12));
+  CHECK(near(swapped.p, result.p, 1e-12));
+}
+
+void test_equal_samples() {
+  std::vector<double> a = {1.0, 2.0, 3.0, 4.0, 5.0};
+  WelchResult result = welch_test(summarize(a), summarize(a));
+  CHECK(result.t == 0.0);
+  CHECK(near(result.p, 1.0, 1e-12));
+}
+
+void test_zero_variance() {
+  std::vector<double> a(10, 2.0);
+  std::vector<double> b(10, 3.0);
+  CHECK(welch_test(summarize(a), summarize(a)).p == 1.0);
+  CHECK(welch_test(summarize(a), summarize(b)).p == 0.0);
+
+  // Variance on one side only is still a regular test.
+  std::vector<double> c = {2.9, 3.0, 3.1, 3.0, 2.9, 3.1, 3.0, 3.0, 2.9, 3.1};
+  WelchResult result = welch_test(summarize(a), summarize(c));
+  CHECK(result.t > 0.0);
+  CHECK(near(result.df, 9.0, 1e-12));
+  CHECK(result.p < 1e-6);
+}
+
+void test_too_few_samples() {
+  std::vector<double> one = {1.0};
+  std::vector<double> many = {1.0, 2.0, 3.0};
+  CHECK(welch_test(summarize(one), summarize(many)).p == 1.0);
+  CHECK(welch_test(summarize(many), summarize({})).p == 1.0);
+}
+
+} // namespace
+
+int main() {
+  test_reference();
+  test_equal_samples();
+  test_zero_variance();
+  test_too_few_samples();
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads running queued tasks in submission order.
+// The destructor finishes every queued task before joining.
+class ThreadPool {
+public:
+  explicit ThreadPool(uint32_t thread_count);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  uint32_t size() const { return static_cast<uint32_t>(workers_.size()); }
+
+  // Queues f and returns a future for its result. Exceptions thrown by f
+  // are rethrown from future::get().
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F &&f) {
+    using Result = std::invoke_result_t<F>;
+    auto task =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+    std::future<Result> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      tasks_.emplace_back([task] { (*task)(); });
+    }
+    wake_.notify_one();
+    return result;
+  }
+
+private:
+  void worker_loop();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,58 @@
+#include "uniform_ring.h"
+
+#include <cstring>
+#include <stdexcept>
+
+void UniformRing::init(VkDevice device, GpuAllocator &allocator,
+                       uint32_t frames_in_flight, VkDeviceSize frame_capacity,
+                       VkDeviceSize alignment) {
+  device_ = device;
+  allocator_ = &allocator;
+  alignment_ = alignment;
+  current_ = 0;
+  frames_ = std::vector<Frame>(frames_in_flight);
+  for (Frame &frame : frames_) {
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = frame_capacity;
+    bufferInfo.usage =
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(device, &bufferInfo, nullptr, &frame.buffer) !=
+        VK_SUCCESS) {
+      throw std::runtime_error{"Failed to create uniform ring buffer!"};
+    }
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, frame.buffer, &requirements);
+    // Device-local host-visible memory, where available, saves the shaders
+    // from reading across the bus.
+    frame.arena.init(allocator, requirements.size,
+                     requirements.memoryTypeBits,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, ResourceKind::Buffer);
+    if (vkBindBufferMemory(device, frame.buffer, frame.arena.memory(), 0) !=
+        VK_SUCCESS) {
+      throw std::runtime_error{"Failed to bind uniform ring memory!"};
+    }
+  }
+}
+
+void UniformRing::destroy() {
+  for (Frame &frame : frames_) {
+    vkDestroyBuffer(device_, frame.buffer, nullptr);
+    frame.arena.destroy(*allocator_);
+  }
+  frames_.clear();
+}
+
+void UniformRing::begin_frame(uint32_t frame) {
+  current_ = frame;
+  frames_[current_].arena.reset();
+}
+
+uint32_t UniformRing::push(const void *data, VkDeviceSize size) {
+  GpuAllocation allocation = frames_[current_].arena.allocate(size, alignment_);
+  std::memcpy(allocation.mapped, data, size);
+  return static_cast<uint32_t>(allocation.offset);
+}
@@ -0,0 +1,57 @@
+#ifndef UNIFORM_RING_H
+#define UNIFORM_RING_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "gpu_allocator.h"
+
+// Persistently mapped buffers for per-frame and per-draw shader data, one
+// per frame in flight, each backed by a LinearArena. Each frame writes its
+// data with push() and binds it through a dynamic offset into a descriptor
+// set that references the whole buffer, so updating it costs a memcpy and
+// no allocation or descriptor write. A frame's arena is reset at once when
+// the frame that last filled it has finished on the GPU.
+class UniformRing {
+public:
+  UniformRing() = default;
+  UniformRing(const UniformRing &) = delete;
+  UniformRing &operator=(const UniformRing &) = delete;
+
+  // alignment is the device's minUniformBufferOffsetAlignment.
+  void init(VkDevice device, GpuAllocator &allocator,
+            uint32_t frames_in_flight, VkDeviceSize frame_capacity,
+            VkDeviceSize alignment);
+  void destroy();
+
+  // Starts filling the buffer of frame, whose previous contents must no
+  // longer be in use.
+  void begin_frame(uint32_t frame);
+  // Copies size bytes into the current frame's buffer and returns their
+  // dynamic offset. Throws when the buffer is full.
+  uint32_t push(const void *data, VkDeviceSize size);
+  template <typename T> uint32_t push(const T &value) {
+    return push(&value, sizeof(T));
+  }
+
+  // The current frame's buffer.
+  VkBuffer buffer() const { return frames_[current_].buffer; }
+  VkBuffer buffer(uint32_t frame) const { return frames_[frame].buffer; }
+
+private:
+  struct Frame {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    // Bound to buffer at offset 0, so arena offsets are buffer offsets.
+    LinearArena arena;
+  };
+
+  VkDevice device_ = VK_NULL_HANDLE;
+  GpuAllocator *allocator_ = nullptr;
+  VkDeviceSize alignment_ = 1;
+  std::vector<Frame> frames_;
+  uint32_t current_ = 0;
+};
+
+#endif // UNIFORM_RING_H